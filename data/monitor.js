@@ -2,61 +2,48 @@
 
 // DOM
 const canvas = document.getElementById("display");
-const ctx = canvas.getContext("2d");
 
 const divSlider = document.getElementById("div-range");
 const posSlider = document.getElementById("pos-range");
 const persistSlider = document.getElementById("persist-range");
 const thickSlider = document.getElementById("thick-range");
 const useCookies = document.getElementById("use-cookies");
+const streamSelect = document.getElementById("stream-profile");
+const renderSelect = document.getElementById("render-mode");
 
 const resSlider = document.getElementById("sample-resolution");
 const durationSlider = document.getElementById("sample-duration");
+const modeSelect = document.getElementById("sample-mode");
+const bitsSelect = document.getElementById("sample-bits");
+const channelsText = document.getElementById("sample-channels");
+const decimationSelect = document.getElementById("sample-decimation");
+const captureSelect = document.getElementById("sample-capture");
+const preSlider = document.getElementById("sample-pretrigger");
+const preText = document.getElementById("pretrigger-text");
+const rateText = document.getElementById("rate-text");
+const sweepText = document.getElementById("sweep-text");
 const freqSlider = document.getElementById("freq-offset");
 const resText = document.getElementById("resolution-text");
 const durText = document.getElementById("duration-text");
 const divText = document.getElementById("div-text");
 const freqText = document.getElementById("freq-text");
+const relockText = document.getElementById("relock-text");
 
-// Could use wss:// (secure socket).
-const gateway = `ws://${window.location.hostname}/ws`;
-let websocket;
-const freqOffsetBuf = new Uint8ClampedArray(1);
+/* The WebSocket, packet decoding and drawing run in a worker (render.js),
+which is handed the canvas, so this thread only handles the controls. */
+const renderer = new Worker("./render.js");
 
-// Data storage
-const maxTriggers = 20; /* Number of triggers' worth of data we remember.*/
-let packets = []; // History of received herald+data packets.
-let triggers = []; // Indices of trigger packets
-let lastDrawnPacket = -1; // Index of most recently drawn packet (in packets)
-let lastDrawnTrigger = -1; // " " (in triggers)
-let herald = null; // Pending herald
-
-// Drawing
-const hiddenDataCanvas = document.createElement('canvas'); // For drawing data.
-const dataCtx = hiddenDataCanvas.getContext('2d');
-/* Rendering data first to a separate, hidden canvas allows us to fade it
-without affecting the underlay, and to reposition it on the screen without
-re-rendering it. Once the OffscreenCanvas API is no longer experimental, may use that.*/
-
-let needsResize = true; // Full re-rendering of the underlay and data
-let needsDataRender = true; // Re-render all data, instead of just new packets.
-let needsReposition = true; // Redraw canvas with new position.
-// New data is rendered by default on each update.
-
-let pendingDisplayUpdate = 0; /* Nonzero long integer request id of a
-requested AnimationFrame, or zero if no redraw pending.*/
-
-function requestDisplayUpdate() {
-  if (!pendingDisplayUpdate) {
-    pendingDisplayUpdate = requestAnimationFrame(updateDisplay);
-    // Manually reset pendingDisplay if the animation frame fails.
-    setTimeout(() => { pendingDisplayUpdate = 0; }, 60);
-  }
-}
+// Div timescale options
+const divScales = [1,5,10, 25, 50, 100, 250, 500]; //milliseconds
+const numDivs = 6; // Horizontal divs
 
 function requestResize() {
-  needsResize = true;
-  requestDisplayUpdate();
+  renderer.postMessage({
+    type: "resize",
+    width: canvas.clientWidth,
+    height: canvas.clientHeight,
+    dpr: window.devicePixelRatio,
+  });
 }
 
 function updatePixelRatio() {
@@ -67,35 +54,12 @@ function updatePixelRatio() {
   matchMedia(`(resolution: ${window.devicePixelRatio}dppx)`).addEventListener("change", updatePixelRatio, { once: true });
 }
 
-/* To avoid drawing more than necessary, we update the canvas 
-at most once per screen refresh (via requestAnimationFrame). This
-also ensures that the screen doesn't refresh midway through a redraw, and
-avoids the need for debouncing high-frequency burst events (like canvas resize).
-
-Each update combines all (and only) changes which need to be made, including
-to the grid underlay, existing data, adding any new data packets and changing
-display position. Events which trigger updates are:
-
-- zoom/dpi change -> everything
-- canvas resize -> everything.
-- div, line-thickness or persistence change -> re-render data
-- position change -> redraw canvas, copying data to new position
-- new data packet -> fade old data and add new.
-
-Each requestAnimationFrame call *adds* a callback to the next frame. We want
-at most one display callback, so we check to see if one was already requested.
-
-If the tab is not visible, most browsers will not run requestAnimationFrame callbacks. Our redraw flags will remain until the next successful
-callback, and we request a full re-render when visibility is returned.
-*/
-
 /* INITIALISATION AND STATUS CHECKS */
 window.addEventListener('load', async () => {
-  updateStatus();
-  setInterval(updateStatus, 10000);
+  divSlider.max = divScales.length - 1;
+  const offscreen = canvas.transferControlToOffscreen();
+  renderer.postMessage({ type: "init", canvas: offscreen, divs: numDivs }, [offscreen]);
   updatePixelRatio();
-  initWebSocket();
-  updateSampleSettings();
   (new ResizeObserver(requestResize)).observe(canvas, { box: "content-box" });
   document.addEventListener('visibilitychange', requestResize);
 
@@ -111,100 +75,179 @@ window.addEventListener('load', async () => {
     persistSlider.value = displaySettings["persist"] || persistSlider.value;
     posSlider.value = displaySettings["pos"] || posSlider.value;
     thickSlider.value = displaySettings["thick"] || thickSlider.value;
+    streamSelect.value = displaySettings["stream"] || streamSelect.value;
+    renderSelect.value = displaySettings["render"] || renderSelect.value;
     useCookies.checked = true;
   } else {
     useCookies.checked = false;
   }
+  sendSubscription();
+  updateDisplaySettings("div", "renderer");
 });
 
-// Initialise WebSocket.
-// Useful reading: https://javascript.info/websocket#data-transfer
-function initWebSocket() {
-  console.log('Trying to open a WebSocket connection...');
-  websocket = new WebSocket(gateway);
-  websocket.binaryType = "arraybuffer";
-  websocket.onopen = () => {
-    console.log("WebSocket connection opened.");
+renderer.onmessage = (event) => {
+  const message = event.data;
+  if (message.type === "sweep") { // Latest sweep analysis
+    sweepText.innerText = `${message.peaks} peaks, ${Math.round(message.clipped * 100)}% clipped`;
+  } else if (message.type === "renderer") { // The chosen renderer failed.
+    renderSelect.value = message.renderer;
+  } else if (message.type === "state") { // Pushed by the board on any change
+    applyState(message.state);
+  } else if (message.type === "ack") {
+    const resolve = pendingCommands.get(message.id);
+    pendingCommands.delete(message.id);
+    if (resolve) { resolve(message.ok); }
+  }
+};
+
+/* Commands go over the WebSocket (via the worker, which owns it), and resolve
+to whether the board applied them. Their effects come back with the state the
+board pushes, as do changes made by other viewers or by the board itself. */
+const pendingCommands = new Map(); // Resolve functions, by id
+let nextCommandId = 0;
+
+function sendCommand(name, args = {}) {
+  return new Promise((resolve) => {
+    const id = ++nextCommandId;
+    pendingCommands.set(id, resolve);
+    renderer.postMessage({ type: "command", id: id, name: name, args: args });
+  });
+}
+
+/* Stream subscriptions: how much the board reduces the stream for this
+viewer. Slow links (e.g. a phone on weak WiFi) should pick a reduced stream,
+so they don't fall behind. */
+const STREAM_PROFILES = {
+  full: { decimate: 1, max_rate: 0, bits: 12 },
+  reduced: { decimate: 4, max_rate: 10, bits: 8 },
+  minimal: { decimate: 16, max_rate: 2, bits: 8 },
+};
+
+function sendSubscription() {
+  // (The worker subscribes again whenever it reconnects.)
+  const profile = STREAM_PROFILES[streamSelect.value] || STREAM_PROFILES.full;
+  renderer.postMessage({ type: "subscribe", profile: profile });
+}
+
+let appliedSettings = null; // Settings last shown (as JSON), so sliders only move when they change
+
+function applyState(state) {
+  const status = state.status;
+  // Add laser name to page title
+  document.title = (status.name) ? "Laser: " + status.name : "Laser";
+  document.getElementById("title").innerText = document.title;
+  // Update switch states
+  slowSwitch.setState(status.slow);
+  fastSwitch.setState(status.fast);
+  // Auto-relock may have moved the offset.
+  relockSwitch.setState(status.relock !== "off");
+  relockText.innerText = status.relock.toUpperCase();
+  if (document.activeElement !== freqSlider) {
+    freqSlider.value = status.pzt;
+    freqText.innerText = status.pzt;
   }
-  websocket.onclose = () => {
-    console.log("WebSocket connection closed.");
-    setTimeout(initWebSocket, 2000); //TODO: better scheme for this.
+  const { effective, ...settings } = state.settings;
+  showEffectiveRate(effective);
+  if (JSON.stringify(settings) !== appliedSettings) {
+    appliedSettings = JSON.stringify(settings);
+    applySettings(settings);
   }
-  websocket.onmessage = onMessage;
 }
 
-// Check the laser's name and state.
-async function updateStatus() {
-  fetch("/status")
-    .then(async (response) => {
-      if (response.ok) {
-        const status = await response.json();
-        // Add laser name to page title
-        document.title = (status.name) ? "Laser: " + status.name : "Laser";
-        document.getElementById("title").innerText = document.title;
-        // Update switch states
-        slowSwitch.setState(status.slow);
-        fastSwitch.setState(status.fast);
-      } else {
-        console.warn("Status check failed.");
-      }
-    })
-    .catch((error) => {
-      console.warn("A connection error occurred.");
-    });
+function applySettings(settings) {
+  /* Show the board's sampling settings, which may differ from the ones we
+  sent (if we sent any; the board pushes them as applied). */
+  modeSelect.value = settings.mode;
+  bitsSelect.value = settings.bits;
+  channelsText.value = settings.channels.join(", ");
+  decimationSelect.value = settings.decimation;
+  captureSelect.value = settings.capture;
+  preSlider.value = settings.pretrigger;
+  preText.innerText = `${Math.round(settings.pretrigger * 100)}%`;
+  // DMA allows much finer resolution than polling.
+  resSlider.min = settings.min_resolution;
+  resSlider.step = Math.min(0.1, settings.min_resolution);
+  resSlider.value = settings.resolution;
+  resText.innerText = formatResolution(settings.resolution);
+  durationSlider.value = settings.duration;
+  durText.innerText = `${settings.duration.toFixed(1)}ms`;
 }
 
 async function updateSampleSettings(write = false) {
-  /* Retrieve the board's sampling settings and bounds, 
+  /* Have the board send its sampling settings and bounds, 
   after optionally attempting to set their values (if write=true)*/
 
   // Temporarily disable settings sliders
   resSlider.disabled = true;
   durationSlider.disabled = true;
-  // Check if sending or merely reading settings values
-  const url = write ? "/set_sample_settings" : "/get_sample_settings";
-  const options = (!write) ? { method: "GET" } :
-    {
-      method: "POST",
-      headers: {
-        'Content-Type': 'application/json', /* Required for ESP's 
-        AsyncCallbackJsonWebHandler to trigger*/
-      },
-      body: JSON.stringify({
-        resolution: Number(resSlider.value),
-        duration: Number(durationSlider.value)
-      })
-    }
-  // Send request
-  fetch(url, options)
-    .then(async (response) => {
-      if (response.ok) {
-        /* Use the retrieved sampling settings, which may differ from the ones
-        we sent (if we sent any)*/
-        const settings = await response.json();
-        resSlider.value = settings.resolution;
-        resText.innerText = `${settings.resolution.toFixed(1)}ms`;
-        durationSlider.value = settings.duration;
-        durText.innerText = `${settings.duration.toFixed(1)}ms`;
-      } else {
-        console.warn("Settings update failed.");
-      }
-    })
-    .catch((error) => {
-      console.warn("A connection error occurred.");
-    })
-    .finally(() => { // Re-enable sliders after a delay.
-      setTimeout(() => {
-        resSlider.disabled = false;
-        durationSlider.disabled = false;
-      }, 500);
+  modeSelect.disabled = true;
+  bitsSelect.disabled = true;
+  channelsText.disabled = true;
+  decimationSelect.disabled = true;
+  captureSelect.disabled = true;
+  preSlider.disabled = true;
+  const sent = (!write) ? sendCommand("state") :
+    sendCommand("settings", {
+      resolution: Number(resSlider.value),
+      duration: Number(durationSlider.value),
+      mode: modeSelect.value,
+      bits: Number(bitsSelect.value),
+      // Pin numbers, e.g. "34, 35"
+      channels: channelsText.value.split(",").map(Number).filter(Number.isInteger),
+      decimation: decimationSelect.value,
+      points: displayPoints(Number(durationSlider.value)),
+      capture: captureSelect.value,
+      pretrigger: Number(preSlider.value)
     });
+  /* Show the settings pushed next even if they match the last shown, as the
+  controls now hold what was asked for. */
+  appliedSettings = null;
+  const ok = await sent;
+  if (!ok) { console.warn("Settings update failed."); }
+  setTimeout(() => { // Re-enable sliders after a delay.
+    resSlider.disabled = false;
+    durationSlider.disabled = false;
+    modeSelect.disabled = false;
+    bitsSelect.disabled = false;
+    channelsText.disabled = false;
+    decimationSelect.disabled = false;
+    captureSelect.disabled = false;
+    preSlider.disabled = false;
+  }, 500);
+}
+
+function showEffectiveRate(effective) {
+  // Rate actually achieved after the board's rate control.
+  rateText.innerText = `${effective.packet_rate.toFixed(1)} packets/s` +
+    ((effective.level > 0) ? ` (reduced, ${effective.points} points)` : "") +
+    (effective.truncated ? " (truncated)" : "");
+}
+
+function displayPoints(duration) {
+  /* Number of pixels a packet of the given duration (ms) spans on the display
+  at the current DIV setting, i.e. how many points are worth sending when
+  the board decimates. */
+  const width = 0.95 * canvas.clientWidth; // Excluding left margin
+  const px_per_ms = width / (divScales[divSlider.value] * numDivs);
+  return Math.max(1, Math.ceil(duration * px_per_ms));
+}
+
+function updateDecimation() {
+  // Decimated packets depend on the display scale, so resend the settings.
+  if (decimationSelect.value !== "none") {
+    updateSampleSettings(true);
+  }
+}
+
+function formatResolution(resolution) {
+  // Resolution in ms, shown in microseconds when below 0.1ms (DMA mode).
+  resolution = Number(resolution);
+  return (resolution < 0.1) ? `${Math.round(resolution * 1000)}\u00b5s` : `${resolution.toFixed(1)}ms`;
 }
 
 function setFreqOffset(offset) {
   // Offset should be an integer from 0-255
-  freqOffsetBuf[0] = offset;
-  websocket.send(freqOffsetBuf);
+  sendCommand("pzt", { offset: Number(offset) });
   freqText.innerText = offset;
   //freqSlider.value = offset;
 }
@@ -217,6 +260,8 @@ function saveDisplaySettings() {
     document.cookie = `pos=${posSlider.value}`;
     document.cookie = `div=${divSlider.value}`;
     document.cookie = `thick=${thickSlider.value}`;
+    document.cookie = `stream=${streamSelect.value}`;
+    document.cookie = `render=${renderSelect.value}`;
     document.cookie = `use-cookies=true`;
   }
 }
@@ -231,277 +276,31 @@ function checkCookies() {
 }
 
 function updateDisplaySettings(...settingNames) {
-  if (settingNames.includes("div")) { needsResize = true; }
-  if (settingNames.includes("pos")) { needsReposition = true; }
-  if (settingNames.includes("persist")) { needsDataRender = true; }
-  if (settingNames.includes("line")) { needsDataRender = true; }
-  requestDisplayUpdate();
-}
-
-/* RECEIVING & DISPLAYING DATA */
-function onMessage(event) { // Handle Websocket message
-  if (event.data instanceof ArrayBuffer) { // Measurement packet (binary)
-    if (herald) { // Make sure a herald came first. Otherwise ignore.
-      herald.measurements = new Uint8Array(event.data);
-      const i = packets.push(herald) - 1; //Record packet and get index
-      if (herald.trigTime !== 0) { //TODO: use NaN or something instead of 0.
-        triggers.push(i);
-        cullData();
-      } else if (packets.length > 2000) {
-        cullData();
-      }
-      herald = null; // Ready for next herald
-      requestDisplayUpdate();
-    }
-  } else { // Herald packet (text)
-    herald = JSON.parse(event.data);
-  }
+  // Pass the display settings to the worker, which redraws what they affect.
+  const divInterval = divScales[divSlider.value];
+  divText.innerText = `${divInterval}ms`;
+  renderer.postMessage({
+    type: "display",
+    settings: {
+      div: divInterval,
+      pos: Number(posSlider.value),
+      persist: Number(persistSlider.value),
+      thick: Number(thickSlider.value),
+      renderer: renderSelect.value,
+    },
+    changed: settingNames,
+  });
 }
 
-function cullData() { // Remove excess data if required.
-  let oldestPacketToKeep = 0;
-  let oldestTriggerToKeep = 0;
-  let cull = false; // Whether we need to cull anything.
-  if (triggers.length > maxTriggers + 10) { 
-    // Remove any triggers/packets older than maxTriggers
-    oldestTriggerToKeep = triggers.length - maxTriggers - 1; // Can assume >= 0
-    oldestPacketToKeep = triggers[oldestTriggerToKeep - 1] + 1; 
-    /* We remove all packets up to the most recent removed trigger packet.*/
-    cull = true;
-  } else if (packets.length > 2000) { // Only keep most recent 1000 packets
-    // Get number of excess packets and corresponding triggers
-    oldestPacketToKeep = packets.length - 1000; // oldest kept = number removed
-
-    while (oldestTriggerToKeep < triggers.length) {
-      if (triggers[oldestTriggerToKeep] < oldestPacketToKeep) {
-        oldestTriggerToKeep++;
-      } else {
-        break;
-      }
-    }
-    cull = true;
-  }
-  if (cull) {
-    // Remove excess packets and triggers, and update packet indices of remaining triggers.
-    packets = packets.slice(oldestPacketToKeep);
-    triggers = triggers.slice(oldestTriggerToKeep).map(i => i - oldestPacketToKeep);
-
-    lastDrawnPacket -= oldestPacketToKeep;
-    lastDrawnTrigger -= oldestTriggerToKeep;
-  }
-}
-
-// Note that updateDisplay is only called when necessary.
-const updateDisplay = (() => {
-  /* Persistent drawing variables (NOTE 'width' EXCLUDES LEFT MARGIN) */
-  let height, width, leftOffset, underlay, px_per_ms, vOffset;
-
-  // Div timescale options
-  const divScales = [1,5,10, 25, 50, 100, 250, 500]; //milliseconds
-  divSlider.max = divScales.length - 1;
-  const numDivs = 6; // Horizontal divs
-
-  dataCtx.globalAlpha = 1;
-  // For gridlines and trigger position line.
-  ctx.globalAlpha = 1;
-  ctx.lineWidth = "1px";
-
-  // Private helper function for drawing a packet
-  function renderPacket(packet, trigtime) {
-    // TODO: highlight clipped signals in red.
-    dataCtx.strokeStyle = "#ffff00"; // Colour for data
-    const meas = packet.measurements;
-    const px_per_datapoint = px_per_ms * packet.elapsed / meas.length;
-    const offset = px_per_ms * (packet.start - trigtime);
-    const px_per_voltbit = 0.75 * height / 255;
-    dataCtx.beginPath();
-    dataCtx.moveTo(offset, meas[0] * px_per_voltbit);
-    for (let i = 1; i < meas.length; i++) {
-      dataCtx.lineTo(offset + i * px_per_datapoint, meas[i] * px_per_voltbit);
-    }
-    dataCtx.stroke();
-  }
-
-  return async () => {
-    if (needsResize) { // Triggered by canvas resize or zoom/dpi change
-      // Resize requires full re-render/draw, so force the corresponding flags.
-      needsDataRender = true;
-      needsReposition = true;
-      // Achieve correct resolution by setting 'drawing width' to pixel width.
-      canvas.width = canvas.clientWidth;
-      canvas.height = canvas.clientHeight;
-      leftOffset = 0.05 * canvas.width; // Space for volt markings
-      height = canvas.height;
-      width = canvas.width - leftOffset;
-      // Set +y to be upwards with origin at the bottom left.
-      ctx.setTransform(1, 0, 0, -1, 0, height);
-      const dpr = window.devicePixelRatio;
-      ctx.scale(dpr, dpr); /* Handle devicePixelRatio behind-the-scenes, so we
-      can work with CSS pixels instead of device pixels */
-
-      /* RenderingContext2D considers a line to be *centred* at a coordinate, so
-      offset by 0.5px to get clear lines when drawn at integer pixel coordinates.*/
-      ctx.translate(0.5, 0.5);
-      /* The data-rendeing canvas has twice the
-      width, and the centre corresponds with the trigger point. Its origin is
-      set at the middle, vOffset from the top. The vertical axis is *not* flipped, to make it easier to copy it right-way-up to the main canvas. */
-      vOffset = height / 10; // Distance of 0V from the bottom
-      hiddenDataCanvas.width = 2 * width;
-      hiddenDataCanvas.height = 2 * height;
-      dataCtx.setTransform(1, 0, 0, 1, width, vOffset);
-      dataCtx.scale(dpr, dpr);
-      dataCtx.translate(0.5, 0.5);
-
-      /* Now redraw the underlay, and save it so we can use it to overwrite
-      the screen when needed. */
-
-      /* Gridline positions are rounded so they don't alias over multiple 
-      pixels.*/
-      ctx.strokeStyle = "cyan";
-      ctx.beginPath();
-      //  Horizontal
-      const vSpacing = height / 4;
-      for (let i = 0; i < 4; i++) {
-        const y = Math.round(vOffset + i * vSpacing);
-        ctx.moveTo(leftOffset, y);
-        ctx.lineTo(canvas.width, y);
-      }
-      //  Vertical
-      const hSpacing = (width * 0.9) / numDivs;
-      const hOffset = leftOffset + width / 2;
-      for (let i = -numDivs / 2; i <= numDivs / 2; i++) {
-        const x = Math.round(hOffset + i * hSpacing);
-        ctx.moveTo(x, 0);
-        ctx.lineTo(x, height);
-      }
-      ctx.stroke();
-
-      /* Voltage markings. Because I've inverted the y-axis, we also
-      have to invert the text drawing. */
-      ctx.fillStyle = "cyan";
-      ctx.textAlign = "right";
-      ctx.textBaseline = "middle";
-      ctx.font = `${0.6 * leftOffset}px sans-serif`;
-      ctx.save(); // Save un-rotated context
-      ctx.translate(leftOffset, vOffset);
-      ctx.scale(1, -1);
-      for (let i = 0; i < 4; i++) {
-        const y = Math.round(i * vSpacing);
-        ctx.fillText(`${i}V `, 0, -y);
-      }
-      ctx.restore();
-
-      // Save underlay for later
-      //underlay = ctx.getImageData(0, 0, canvas.width, height);
-      underlay = await createImageBitmap(canvas, { imageOrientation: "flipY" });
-      needsResize = false;
-    }
-
-    if (needsDataRender) { // Redraw *all* data to hidden canvas
-      // Re-compute data scale
-      const divInterval = divScales[divSlider.value];
-      divText.innerText = `${divInterval}ms`;
-      px_per_ms = width / (divInterval * numDivs);
-
-      // Say all packets/triggers need to be (re)drawn.
-      lastDrawnPacket = -1;
-      lastDrawnTrigger = -1;
-
-      needsDataRender = false;
-    }
-
-    /* Draw all packets waiting to be drawn */
-    dataCtx.lineWidth = thickSlider.value;
-    if (lastDrawnTrigger >= 0) { // There's a previous trigger to draw from.
-      let trigTime = packets[triggers[lastDrawnTrigger]].trigTime;
-      // Packet to start from
-      let packetIndex = (lastDrawnPacket < 0) ? 0 : lastDrawnPacket;
-      // Packet to draw up to (exclusive) (stops at new trig or end of packets)
-      const stopIndex = (lastDrawnTrigger < triggers.length - 1) ? triggers[lastDrawnTrigger + 1] : packets.length;
-      // Rightmost time on screen
-      const maxTime = trigTime + px_per_ms * width;
-      while (packetIndex < stopIndex) {
-        // Continue previous trigger (forwards only)
-        const packet = packets[packetIndex++];
-        if (packet.start > maxTime) { break; }
-        renderPacket(packet, trigTime);
-      }
-      lastDrawnPacket = packetIndex;
-    }
-    //Any new trigger cycles
-    let trigIndex = Math.max(lastDrawnTrigger + 1, 0);
-    const trigCount = triggers.length;
-    for (trigIndex; trigIndex < trigCount; trigIndex++) {
-      // Fade previous data
-      dataCtx.fillStyle = `rgba(255,255,255,${persistSlider.value})`;
-      //dataCtx.fillStyle = window.getComputedStyle(canvas).backgroundColor;
-      dataCtx.globalCompositeOperation = "destination-in";
-      dataCtx.fillRect(-width, 0, hiddenDataCanvas.width, height);
-      dataCtx.globalCompositeOperation = "source-over";
-
-      const trigPacketIndex = triggers[trigIndex];
-      const trigPacket = packets[trigPacketIndex];
-      const trigTime = trigPacket.trigTime;
-      const minTime = trigTime - px_per_ms * width; // Display bounds
-      const maxTime = trigTime + px_per_ms * width;
-
-      for (let i = trigPacketIndex-1; i >= 0; i--) { // Draw backwards from trigger point
-        const packet = packets[i];
-        if (packet.start + packet.elapsed < minTime) { break; }
-        renderPacket(packet, trigTime);
-      }
-      for (let i = trigPacketIndex; i < packets.length; i++) { // Forwards from trigger point (including trigger packet itself)
-        const packet = packets[i];
-        if (packet.start > maxTime) { break; }
-        renderPacket(packet, trigTime);
-        lastDrawnPacket = i;
-      }
-      lastDrawnTrigger = trigIndex;
-    }
-
-    const pos = Math.round(leftOffset + Number(posSlider.value) * (width - 1));
-    needsReposition = true;
-    if (needsReposition) {
-      // Clear canvas and redraw underlay
-      ctx.clearRect(0, 0, canvas.width, height);
-      ctx.drawImage(underlay, -0.5, -0.5);
-      // Redraw position indicator
-      const delta = 0.02 * height; // Size of indicator arrow
-      ctx.strokeStyle = "#ffff00";
-      ctx.fillStyle = "#ffff00";
-      ctx.beginPath(); // Main line
-      ctx.moveTo(pos, -1);
-      ctx.lineTo(pos, height + 1);
-      ctx.stroke();
-      ctx.beginPath(); // Top triangle
-      ctx.moveTo(pos - delta, height + 1);
-      ctx.lineTo(pos, height - delta);
-      ctx.lineTo(pos + delta, height + 1);
-      ctx.fill();
-      ctx.beginPath(); // Bottom triangle
-      ctx.moveTo(pos - delta, -1);
-      ctx.lineTo(pos, delta);
-      ctx.lineTo(pos + delta, -1);
-      ctx.fill();
-      needsReposition = false;
-
-      // Finally, in every display update we redraw the data onto the display
-      ctx.drawImage(hiddenDataCanvas, leftOffset + width - pos, 0, width, height, leftOffset, 0, width, height)
-      /* Necessary to respect transparency */
-    }
-    // Complete.
-    pendingDisplayUpdate = 0;
-  }
-})();
-
 /* SENDING INSTRUCTIONS */
 class LiveSwitch {
-  /* A switch which avoids being out of sync with the board. */
-  constructor(button, url_on, url_off) {
+  /* A switch which avoids being out of sync with the board. It shows the
+  state the board pushes, rather than assuming its commands worked. */
+  constructor(button, command, args = {}) {
     this.button = button;
     this.button.addEventListener('click', this.onclick.bind(this));
-    this.url_on = url_on;
-    this.url_off = url_off;
+    this.command = command;
+    this.args = args; // Besides "on"
     this.active = true;
   }
 
@@ -515,32 +314,16 @@ class LiveSwitch {
     }
   }
 
-  onclick() {
+  async onclick() {
     this.button.disabled = true; // Temporarily disable switch
-    const url = (this.active) ? this.url_off : this.url_on;
-
-    fetch(url, { method: "POST" })
-      .then((response) => {
-        if (response.ok) { // Toggle switch value
-          this.setState(!this.active);
-        } else {
-          console.warn("The ESP failed to execute the command.");
-        }
-      })
-      .catch((error) => {
-        console.warn("A connection error occurred.");
-      })
-      .finally(() => {
-        /* After all is said and done, re-enable the button
-        (after a short delay to prevent spamming) */
-        setTimeout(() => { this.button.disabled = false; }, 500);
-      });
+    const ok = await sendCommand(this.command, { ...this.args, on: !this.active });
+    if (!ok) { console.warn("The ESP failed to execute the command."); }
+    /* After all is said and done, re-enable the button
+    (after a short delay to prevent spamming) */
+    setTimeout(() => { this.button.disabled = false; }, 500);
   }
 }
 
-const slowSwitch = new LiveSwitch(
-  document.getElementById("slow-lock"), "/enable_slow", "/disable_slow"
-);
-const fastSwitch = new LiveSwitch(
-  document.getElementById("fast-lock"), "/enable_fast", "/disable_fast"
-);
\ No newline at end of file
+const slowSwitch = new LiveSwitch(document.getElementById("slow-lock"), "lock", { lock: "slow" });
+const fastSwitch = new LiveSwitch(document.getElementById("fast-lock"), "lock", { lock: "fast" });
+const relockSwitch = new LiveSwitch(document.getElementById("auto-relock"), "relock");
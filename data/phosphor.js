@@ -0,0 +1,222 @@
+/* WebGL phosphor display, loaded into the render.js worker when the PHOSPHOR
+renderer is chosen. Traces are added up in an intensity buffer, which is
+faded on the GPU at each trigger, so a trace that repeats sweep after sweep
+glows brighter than a one-off glitch, as on an analogue scope. The whole
+sample store of the PacketRing is mirrored in a texture, updated as packets
+arrive, so each packet is uploaded once however often it is redrawn; trigger
+alignment and scaling are done in the vertex shader. Lines are always one
+pixel wide (WebGL ignores lineWidth). */
+
+const PHOSPHOR_TEXTURE_WIDTH = 2048; // Samples per texture row (WebGL2 guarantees 2048)
+const PHOSPHOR_INTENSITY = 0.35; // Brightness added by each trace
+
+const PHOSPHOR_TRACE_VERTEX = `#version 300 es
+// Point p of one channel is vertex p * perChannel + k (k picks min or max).
+uniform highp usampler2D samples;
+uniform int base;         // Index of the channel's first sample
+uniform int step;         // Samples per point
+uniform int perChannel;   // 2 for (min, max) pairs, otherwise 1
+uniform float start;      // Packet start relative to the trigger (ms)
+uniform float resolution; // ms per point
+uniform float pxPerMs;
+uniform float pxPerBit;
+uniform vec2 origin;      // Trigger point, and 0V (device pixels)
+uniform float dpr;
+uniform vec2 size;        // Of the buffer (device pixels)
+void main() {
+  int p = gl_VertexID / perChannel;
+  int i = base + p * step + (gl_VertexID - p * perChannel);
+  float v = float(texelFetch(samples, ivec2(i % ${PHOSPHOR_TEXTURE_WIDTH}, i / ${PHOSPHOR_TEXTURE_WIDTH}), 0).r);
+  vec2 px = origin + dpr * vec2((start + float(p) * resolution) * pxPerMs, v * pxPerBit);
+  // Rows run downwards, as on the 2D canvas it replaces.
+  gl_Position = vec4(2.0 * px.x / size.x - 1.0, 1.0 - 2.0 * px.y / size.y, 0.0, 1.0);
+}`;
+
+const PHOSPHOR_TRACE_FRAGMENT = `#version 300 es
+precision mediump float;
+uniform vec4 colour;
+out vec4 result;
+void main() { result = colour; }`;
+
+const PHOSPHOR_QUAD_VERTEX = `#version 300 es
+// Full-screen triangle
+void main() {
+  vec2 corner = vec2(float((gl_VertexID & 1) << 2), float((gl_VertexID & 2) << 1));
+  gl_Position = vec4(corner - 1.0, 0.0, 1.0);
+}`;
+
+const PHOSPHOR_FADE_FRAGMENT = `#version 300 es
+precision mediump float;
+out vec4 result;
+void main() { result = vec4(0.0); } // (Blending does the fade.)`;
+
+const PHOSPHOR_PRESENT_FRAGMENT = `#version 300 es
+precision highp float;
+uniform highp sampler2D intensity; // (Can exceed 1)
+out vec4 result;
+void main() {
+  // Saturate smoothly, so overlapping traces brighten without clipping.
+  vec3 glow = 1.0 - exp(-2.0 * texelFetch(intensity, ivec2(gl_FragCoord.xy), 0).rgb);
+  result = vec4(glow, max(glow.r, max(glow.g, glow.b))); // Premultiplied
+}`;
+
+class PhosphorLayer {
+  constructor(ring) {
+    // Throws if WebGL2 isn't available.
+    this.ring = ring;
+    this.canvas = new OffscreenCanvas(1, 1);
+    const gl = this.canvas.getContext("webgl2", { antialias: false, preserveDrawingBuffer: true });
+    if (!gl) { throw new Error("WebGL2 is unavailable."); }
+    this.gl = gl;
+    this.trace = this.program(PHOSPHOR_TRACE_VERTEX, PHOSPHOR_TRACE_FRAGMENT);
+    this.fadeProgram = this.program(PHOSPHOR_QUAD_VERTEX, PHOSPHOR_FADE_FRAGMENT);
+    this.present = this.program(PHOSPHOR_QUAD_VERTEX, PHOSPHOR_PRESENT_FRAGMENT);
+    this.vertexArray = gl.createVertexArray(); // (No attributes; vertices come from gl_VertexID.)
+    // Half floats give finer grading, where rendering to them is supported.
+    this.floatIntensity = Boolean(gl.getExtension("EXT_color_buffer_float"));
+
+    this.rows = Math.ceil(ring.samples.length / PHOSPHOR_TEXTURE_WIDTH);
+    this.samples = gl.createTexture();
+    gl.bindTexture(gl.TEXTURE_2D, this.samples);
+    gl.texStorage2D(gl.TEXTURE_2D, 1, gl.R16UI, PHOSPHOR_TEXTURE_WIDTH, this.rows);
+    gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MIN_FILTER, gl.NEAREST);
+    gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MAG_FILTER, gl.NEAREST);
+    this.uploaded = 0; // Packets up to here are in the texture.
+
+    this.intensity = null;
+    this.framebuffer = gl.createFramebuffer();
+  }
+
+  program(vertexSource, fragmentSource) {
+    const gl = this.gl;
+    const program = gl.createProgram();
+    for (const [type, source] of [[gl.VERTEX_SHADER, vertexSource], [gl.FRAGMENT_SHADER, fragmentSource]]) {
+      const shader = gl.createShader(type);
+      gl.shaderSource(shader, source);
+      gl.compileShader(shader);
+      if (!gl.getShaderParameter(shader, gl.COMPILE_STATUS)) {
+        throw new Error(gl.getShaderInfoLog(shader));
+      }
+      gl.attachShader(program, shader);
+    }
+    gl.linkProgram(program);
+    if (!gl.getProgramParameter(program, gl.LINK_STATUS)) {
+      throw new Error(gl.getProgramInfoLog(program));
+    }
+    program.uniforms = {};
+    const count = gl.getProgramParameter(program, gl.ACTIVE_UNIFORMS);
+    for (let i = 0; i < count; i++) {
+      const name = gl.getActiveUniform(program, i).name;
+      program.uniforms[name] = gl.getUniformLocation(program, name);
+    }
+    return program;
+  }
+
+  resize(width, height) {
+    // Size in device pixels, matching the 2D data canvas. Clears the display.
+    const gl = this.gl;
+    this.canvas.width = width;
+    this.canvas.height = height;
+    if (this.intensity) { gl.deleteTexture(this.intensity); }
+    this.intensity = gl.createTexture();
+    gl.bindTexture(gl.TEXTURE_2D, this.intensity);
+    gl.texStorage2D(gl.TEXTURE_2D, 1, this.floatIntensity ? gl.RGBA16F : gl.RGBA8, width, height);
+    gl.bindFramebuffer(gl.FRAMEBUFFER, this.framebuffer);
+    gl.framebufferTexture2D(gl.FRAMEBUFFER, gl.COLOR_ATTACHMENT0, gl.TEXTURE_2D, this.intensity, 0);
+    gl.viewport(0, 0, width, height);
+    gl.clearColor(0, 0, 0, 0);
+    gl.clear(gl.COLOR_BUFFER_BIT);
+  }
+
+  setView(origin, dpr, pxPerMs, lineColours) {
+    // Where the trigger and 0V are (device pixels), and the scales.
+    this.origin = origin;
+    this.dpr = dpr;
+    this.pxPerMs = pxPerMs;
+    this.colours = lineColours.map((hex) => [1, 3, 5].map((i) => parseInt(hex.substr(i, 2), 16) / 255));
+  }
+
+  upload() {
+    // Copy packets stored since the last upload into the texture.
+    const gl = this.gl;
+    const ring = this.ring;
+    gl.bindTexture(gl.TEXTURE_2D, this.samples);
+    for (let n = Math.max(this.uploaded, ring.tail); n < ring.head; n++) {
+      const i = ring.slot(n);
+      if (ring.count[i] === 0) { continue; }
+      const firstRow = Math.floor(ring.offset[i] / PHOSPHOR_TEXTURE_WIDTH);
+      const lastRow = Math.floor((ring.offset[i] + ring.count[i] - 1) / PHOSPHOR_TEXTURE_WIDTH);
+      gl.texSubImage2D(gl.TEXTURE_2D, 0, 0, firstRow, PHOSPHOR_TEXTURE_WIDTH, lastRow - firstRow + 1,
+        gl.RED_INTEGER, gl.UNSIGNED_SHORT, ring.samples, firstRow * PHOSPHOR_TEXTURE_WIDTH);
+    }
+    this.uploaded = ring.head;
+  }
+
+  fade(persist) {
+    // Scale down everything drawn so far (towards transparent).
+    const gl = this.gl;
+    gl.bindFramebuffer(gl.FRAMEBUFFER, this.framebuffer);
+    gl.useProgram(this.fadeProgram);
+    gl.enable(gl.BLEND);
+    gl.blendColor(0, 0, 0, persist);
+    gl.blendFunc(gl.ZERO, gl.CONSTANT_ALPHA);
+    gl.bindVertexArray(this.vertexArray);
+    gl.drawArrays(gl.TRIANGLES, 0, 3);
+  }
+
+  drawPacket(n, trigtime, pxPerBit) {
+    // Add packet n's traces, aligned so trigtime is at the origin.
+    const gl = this.gl;
+    const ring = this.ring;
+    const i = ring.slot(n);
+    const channels = ring.channels[i];
+    const perChannel = ring.envelope[i] ? 2 : 1;
+    const step = perChannel * channels;
+    const points = Math.floor(ring.count[i] / step);
+    if (points === 0) { return; }
+    const u = this.trace.uniforms;
+    gl.bindFramebuffer(gl.FRAMEBUFFER, this.framebuffer);
+    gl.useProgram(this.trace);
+    gl.enable(gl.BLEND);
+    gl.blendFunc(gl.ONE, gl.ONE); // Traces add up.
+    gl.bindVertexArray(this.vertexArray);
+    gl.activeTexture(gl.TEXTURE0);
+    gl.bindTexture(gl.TEXTURE_2D, this.samples);
+    gl.uniform1i(u.samples, 0);
+    gl.uniform1i(u.step, step);
+    gl.uniform1i(u.perChannel, perChannel);
+    gl.uniform1f(u.start, ring.start[i] - trigtime);
+    gl.uniform1f(u.resolution, ring.resolution[i]);
+    gl.uniform1f(u.pxPerMs, this.pxPerMs);
+    gl.uniform1f(u.pxPerBit, pxPerBit);
+    gl.uniform2f(u.origin, this.origin[0], this.origin[1]);
+    gl.uniform1f(u.dpr, this.dpr);
+    gl.uniform2f(u.size, this.canvas.width, this.canvas.height);
+    for (let c = 0; c < channels; c++) {
+      const [r, g, b] = this.colours[c % this.colours.length];
+      gl.uniform4f(u.colour, r * PHOSPHOR_INTENSITY, g * PHOSPHOR_INTENSITY, b * PHOSPHOR_INTENSITY, PHOSPHOR_INTENSITY);
+      gl.uniform1i(u.base, ring.offset[i] + c * perChannel);
+      gl.drawArrays(gl.LINE_STRIP, 0, points * perChannel);
+    }
+  }
+
+  render() {
+    // Tone-map the intensities onto the canvas, and return it for drawImage.
+    const gl = this.gl;
+    gl.bindFramebuffer(gl.FRAMEBUFFER, null);
+    gl.disable(gl.BLEND);
+    gl.useProgram(this.present);
+    gl.activeTexture(gl.TEXTURE0);
+    gl.bindTexture(gl.TEXTURE_2D, this.intensity);
+    gl.uniform1i(this.present.uniforms.intensity, 0);
+    gl.bindVertexArray(this.vertexArray);
+    gl.drawArrays(gl.TRIANGLES, 0, 3);
+    return this.canvas;
+  }
+
+  release() {
+    // Give up the GPU memory now, rather than whenever it's collected.
+    const lose = this.gl.getExtension("WEBGL_lose_context");
+    if (lose) { lose.loseContext(); }
+  }
+}
@@ -0,0 +1,731 @@
+/* Display worker for the remote browser oscilloscope. It receives the data
+stream, decodes packets and draws them onto the display canvas (handed over by
+monitor.js as an OffscreenCanvas), so dragging sliders or resizing the page
+doesn't hold up incoming data, and drawing doesn't hold up the page. The page
+sends its display settings and WebSocket commands here as messages (see
+onmessage below). */
+
+// Could use wss:// (secure socket).
+const gateway = `ws://${self.location.hostname}/ws`;
+let websocket;
+let subscription = null; // Stream profile to subscribe to on connecting
+
+/* Commands to the board (see Commands in main.cpp). The page names them, and
+the worker encodes and numbers them, and passes back each acknowledgement
+(or a failure, if the connection closes first) with the page's id. */
+const COMMAND_OPCODES = { lock: 1, relock: 2, pzt: 3, settings: 4, state: 5 };
+const ACK_KIND = 0xA0; // First byte of an acknowledgement (never a packet version)
+const ACK_SIZE = 6;
+const COMMAND_OK = 0;
+const SETTINGS_SIZE = 17 + 4; // SettingsCommand, with room for 4 pins
+const MODE_CODES = { polled: 0, dma: 1 };
+const DECIMATION_CODES = { none: 0, average: 1, envelope: 2 };
+const CAPTURE_CODES = { continuous: 0, triggered: 1 };
+let commandSequence = 0;
+const pendingCommands = new Map(); // Page's ids, by sequence number
+
+// Data storage
+const maxTriggers = 20; /* Number of triggers' worth of data we remember.*/
+const maxPackets = 2048; // Most packets remembered
+const maxStoredSamples = 1 << 22; // Room for samples, shared by all packets
+let lastDrawnPacket = -1; // Number of most recently drawn packet (see PacketRing)
+let lastDrawnTrigger = -1; // " " trigger
+let lastSequence = -1; // Sequence number of the most recent packet
+let droppedPackets = 0; // Number of packets missing from the sequence
+let latestAnalysed = -1; // Newest packet with a sweep analysis, not yet reported
+
+// Drawing (the canvas comes with the page's "init" message)
+let canvas, ctx;
+const hiddenDataCanvas = new OffscreenCanvas(1, 1); // For drawing data.
+const dataCtx = hiddenDataCanvas.getContext('2d');
+/* Rendering data first to a separate, hidden canvas allows us to fade it
+without affecting the underlay, and to reposition it on the screen without
+re-rendering it.*/
+const CHANNEL_COLOURS = ["#ffff00", "#ff00ff", "#00ff80", "#ff8000"]; // Per input channel
+let numDivs = 6; // Horizontal divs
+const view = { width: 1, height: 1, dpr: 1 }; // Canvas size (CSS pixels) and pixel ratio
+const display = { div: 10, pos: 0.5, persist: 0.7, thick: 1, renderer: "2d" }; // Display settings (div in ms)
+let phosphor = null; // WebGL renderer (see phosphor.js), if chosen
+let calibration = null; // The board's ADC calibration (see loadCalibration)
+
+let needsResize = true; // Full re-rendering of the underlay and data
+let needsDataRender = true; // Re-render all data, instead of just new packets.
+let needsReposition = true; // Redraw canvas with new position.
+// New data is rendered by default on each update.
+
+let pendingDisplayUpdate = 0; /* Nonzero long integer request id of a
+requested AnimationFrame, or zero if no redraw pending.*/
+
+// (Workers gained requestAnimationFrame later than OffscreenCanvas.)
+const requestFrame = self.requestAnimationFrame ?
+  self.requestAnimationFrame.bind(self) : (callback) => setTimeout(callback, 16);
+
+function requestDisplayUpdate() {
+  if (!pendingDisplayUpdate) {
+    pendingDisplayUpdate = requestFrame(updateDisplay);
+    // Manually reset pendingDisplay if the animation frame fails.
+    setTimeout(() => { pendingDisplayUpdate = 0; }, 60);
+  }
+}
+
+function requestResize() {
+  needsResize = true;
+  requestDisplayUpdate();
+}
+
+/* To avoid drawing more than necessary, we update the canvas 
+at most once per screen refresh (via requestAnimationFrame). This
+also ensures that the screen doesn't refresh midway through a redraw, and
+avoids the need for debouncing high-frequency burst events (like canvas resize).
+
+Each update combines all (and only) changes which need to be made, including
+to the grid underlay, existing data, adding any new data packets and changing
+display position. Events which trigger updates are:
+
+- zoom/dpi change -> everything
+- canvas resize -> everything.
+- div, line-thickness or persistence change -> re-render data
+- position change -> redraw canvas, copying data to new position
+- new data packet -> fade old data and add new.
+
+Each requestAnimationFrame call *adds* a callback to the next frame. We want
+at most one display callback, so we check to see if one was already requested.
+
+If the tab is not visible, most browsers will not run requestAnimationFrame callbacks. Our redraw flags will remain until the next successful
+callback, and we request a full re-render when visibility is returned.
+*/
+
+/* MESSAGES FROM THE PAGE */
+onmessage = (event) => {
+  const message = event.data;
+  switch (message.type) {
+    case "init": // The canvas; the data stream then starts.
+      canvas = message.canvas;
+      ctx = canvas.getContext("2d");
+      numDivs = message.divs;
+      // For gridlines and trigger position line.
+      ctx.globalAlpha = 1;
+      ctx.lineWidth = "1px";
+      initWebSocket();
+      loadCalibration();
+      break;
+    case "resize": // Canvas size or pixel ratio changed, or the page became visible.
+      view.width = message.width;
+      view.height = message.height;
+      view.dpr = message.dpr;
+      requestResize();
+      break;
+    case "display": // Display settings, and the names of those changed
+      Object.assign(display, message.settings);
+      updateDisplaySettings(...message.changed);
+      break;
+    case "subscribe":
+      subscription = message.profile;
+      sendSubscription();
+      break;
+    case "command": // A named command, with its arguments and the page's id
+      sendCommand(message.id, message.name, message.args);
+      break;
+  }
+};
+
+function encodeCommand(name, args, sequence) {
+  // A command message (CommandHeader and payload), or null if unknown.
+  const opcode = COMMAND_OPCODES[name];
+  if (!opcode) { return null; }
+  let payload = [];
+  switch (name) {
+    case "lock": payload = [(args.lock === "fast") ? 1 : 0, args.on ? 1 : 0]; break;
+    case "relock": payload = [args.on ? 1 : 0]; break;
+    case "pzt": payload = [args.offset]; break;
+    case "settings": { // (Times in ms, as the page has them)
+      const settings = new DataView(new ArrayBuffer(SETTINGS_SIZE));
+      const pins = args.channels.slice(0, 4);
+      settings.setUint32(0, Math.round(args.resolution * 1000), true);
+      settings.setUint32(4, Math.round(args.duration * 1000), true);
+      settings.setUint16(8, Math.min(args.points, 0xFFFF), true);
+      settings.setUint16(10, Math.round(args.pretrigger * 0xFFFF), true);
+      settings.setUint8(12, MODE_CODES[args.mode] ?? 0);
+      settings.setUint8(13, args.bits);
+      settings.setUint8(14, DECIMATION_CODES[args.decimation] ?? 0);
+      settings.setUint8(15, CAPTURE_CODES[args.capture] ?? 0);
+      settings.setUint8(16, pins.length);
+      pins.forEach((pin, c) => settings.setUint8(17 + c, pin));
+      payload = new Uint8Array(settings.buffer);
+      break;
+    }
+  }
+  const command = new Uint8Array(4 + payload.length);
+  const header = new DataView(command.buffer);
+  header.setUint8(0, opcode);
+  header.setUint16(2, sequence, true);
+  command.set(payload, 4);
+  return command;
+}
+
+function sendCommand(id, name, args) {
+  if (!websocket || websocket.readyState !== WebSocket.OPEN) {
+    postMessage({ type: "ack", id: id, ok: false });
+    return;
+  }
+  commandSequence = (commandSequence + 1) & 0xFFFF;
+  const command = encodeCommand(name, args || {}, commandSequence);
+  if (!command) {
+    postMessage({ type: "ack", id: id, ok: false });
+    return;
+  }
+  pendingCommands.set(commandSequence, id);
+  websocket.send(command);
+}
+
+function onAck(data) {
+  const ack = new DataView(data);
+  const sequence = ack.getUint16(2, true);
+  if (!pendingCommands.has(sequence)) { return; }
+  postMessage({ type: "ack", id: pendingCommands.get(sequence), ok: ack.getUint8(4) === COMMAND_OK });
+  pendingCommands.delete(sequence);
+}
+
+function failCommands() {
+  // The connection closed, so commands awaiting acknowledgement are lost.
+  for (const id of pendingCommands.values()) { postMessage({ type: "ack", id: id, ok: false }); }
+  pendingCommands.clear();
+}
+
+function updateDisplaySettings(...settingNames) {
+  if (settingNames.includes("div")) { needsResize = true; }
+  if (settingNames.includes("renderer")) { needsResize = true; }
+  if (settingNames.includes("pos")) { needsReposition = true; }
+  if (settingNames.includes("persist")) { needsDataRender = true; }
+  if (settingNames.includes("line")) { needsDataRender = true; }
+  requestDisplayUpdate();
+}
+
+// Initialise WebSocket.
+// Useful reading: https://javascript.info/websocket#data-transfer
+function initWebSocket() {
+  console.log('Trying to open a WebSocket connection...');
+  websocket = new WebSocket(gateway);
+  websocket.binaryType = "arraybuffer";
+  websocket.onopen = () => {
+    console.log("WebSocket connection opened.");
+    sendSubscription();
+  }
+  websocket.onclose = () => {
+    console.log("WebSocket connection closed.");
+    failCommands();
+    setTimeout(initWebSocket, 2000); //TODO: better scheme for this.
+  }
+  websocket.onmessage = onMessage;
+}
+
+function sendSubscription() {
+  if (!subscription || !websocket || websocket.readyState !== WebSocket.OPEN) { return; }
+  websocket.send(JSON.stringify({ subscribe: subscription }));
+}
+
+function loadCalibration() {
+  /* Millivolts of every calibration.step-th ADC code (12-bit scale), as
+  measured by the board, so the grid is labelled in real volts. */
+  fetch("/calibration")
+    .then((response) => response.ok ? response.json() : null)
+    .then((result) => {
+      if (!result) { return; }
+      calibration = result;
+      requestResize();
+    })
+    .catch((error) => {
+      console.warn("ADC calibration unavailable.");
+    });
+}
+
+function codeVolts(code) {
+  // Calibrated voltage of a 12-bit ADC code, interpolated.
+  const table = calibration.millivolts;
+  const i = Math.min(Math.floor(code / calibration.step), table.length - 2);
+  const x = code / calibration.step - i;
+  return (table[i] + x * (table[i + 1] - table[i])) / 1000;
+}
+
+function setupPhosphor() {
+  // Start or stop the WebGL renderer, as chosen. Falls back to 2D if it fails.
+  if (display.renderer === "phosphor" && !phosphor) {
+    try {
+      importScripts("./phosphor.js");
+      phosphor = new PhosphorLayer(packets);
+    } catch (error) {
+      console.warn(`WebGL renderer unavailable (${error.message}); drawing in 2D.`);
+      display.renderer = "2d";
+      postMessage({ type: "renderer", renderer: "2d" });
+    }
+  } else if (display.renderer !== "phosphor" && phosphor) {
+    phosphor.release();
+    phosphor = null;
+  }
+}
+
+/* RECEIVING & DISPLAYING DATA */
+/* Binary packet format (see PacketHeader in main.cpp). All little-endian.
+Byte offsets of the header fields: */
+const PACKET_FORMAT_VERSION = 1;
+const HEADER = {
+  version: 0, // uint8
+  headerSize: 1, // uint8
+  flags: 2, // uint16
+  sequence: 4, // uint32
+  start: 8, // uint64, microseconds
+  elapsed: 16, // uint32, microseconds
+  trigOffset: 20, // int32, microseconds from start (only trigger from older firmware)
+  samples: 24, // uint32
+  resolution: 28, // uint32, microseconds
+  clipped: 32, // uint16, fraction * 65535
+  peakCount: 34, // uint8
+  channels: 35, // uint8, samples per frame (0 from older firmware, meaning 1)
+  zeroCrossing: 36, // int32, microseconds from start
+  peaks: 40, // Up to 4 of (uint32 microseconds from start, uint16 depth)
+  triggerCount: 64, // uint8
+  triggers: 68, // Up to 8 int32, points from start in 1/256ths
+};
+const HEADER_PEAK_SIZE = 6;
+const HEADER_ANALYSIS_END = 64; // Older firmware sent shorter headers.
+const HEADER_TRIGGERS_END = 100;
+const TRIGGER_FRACTION = 256;
+const FLAG_TRIGGERED = 1 << 0;
+const FLAG_DMA = 1 << 1;
+const FLAG_12BIT = 1 << 2;
+const FLAG_AVERAGE = 1 << 3;
+const FLAG_ENVELOPE = 1 << 4;
+const FLAG_ZERO_CROSSING = 1 << 5;
+
+/* Received packets, kept in a ring of preallocated typed arrays so that
+arriving data allocates nothing (garbage collection otherwise causes periodic
+hitches at short durations). Packets and triggers are numbered from when the
+page loaded; packet n's fields are at index slot(n) of each array, and its
+samples at samples[offset, offset + count). A packet can hold several triggers
+(one per sweep), each kept with its own time. Samples are stored one after
+another, wrapping around to the start; arriving packets evict the oldest when
+the ring or the sample space is full, or when there are more than maxTriggers
+triggers. */
+class PacketRing {
+  constructor(capacity, sampleCapacity, triggerCapacity) {
+    this.capacity = capacity;
+    this.start = new Float64Array(capacity); // ms
+    this.elapsed = new Float64Array(capacity); // ms
+    this.resolution = new Float64Array(capacity); // ms
+    this.sequence = new Uint32Array(capacity);
+    this.channels = new Uint8Array(capacity);
+    this.envelope = new Uint8Array(capacity); // 1 for (min, max) pairs
+    this.fullScale = new Uint16Array(capacity); // Maximum sample value
+    this.clipped = new Float32Array(capacity); // Fraction, from the board's analysis (NaN if none)
+    this.peakCount = new Uint8Array(capacity); // " "
+    this.offset = new Uint32Array(capacity);
+    this.count = new Uint32Array(capacity);
+    this.samples = new Uint16Array(sampleCapacity);
+    this.triggerCapacity = triggerCapacity;
+    this.triggerPackets = new Float64Array(triggerCapacity); // Packet number of each trigger
+    this.triggerTimes = new Float64Array(triggerCapacity); // ms
+    this.tail = 0; // Oldest packet kept
+    this.head = 0; // Next packet number
+    this.triggerTail = 0;
+    this.triggerHead = 0;
+    this.sampleHead = 0; // Where the next packet's samples go
+  }
+
+  slot(n) { return n % this.capacity; }
+
+  triggerPacket(t) { return this.triggerPackets[t % this.triggerCapacity]; }
+
+  triggerTime(t) { return this.triggerTimes[t % this.triggerCapacity]; }
+
+  evict() { // Forget the oldest packet, and any trigger in it.
+    this.tail++;
+    while (this.triggerTail < this.triggerHead && this.triggerPacket(this.triggerTail) < this.tail) {
+      this.triggerTail++;
+    }
+  }
+
+  store(buffer) {
+    /* Decode a packet (see HEADER) into the ring. Times are converted to
+    milliseconds. Returns its number, or -1 for packets in an unknown format. */
+    const view = new DataView(buffer);
+    if (view.getUint8(HEADER.version) !== PACKET_FORMAT_VERSION) {
+      return -1;
+    }
+    const headerSize = view.getUint8(HEADER.headerSize);
+    const flags = view.getUint16(HEADER.flags, true);
+    const is12Bit = Boolean(flags & FLAG_12BIT);
+    const count = Math.min(view.getUint32(HEADER.samples, true), this.samples.length);
+
+    // Make room for the samples.
+    let at = this.sampleHead;
+    if (at + count > this.samples.length) { // Wrap around, past what's stored at the end.
+      while (this.tail < this.head && this.offset[this.slot(this.tail)] >= at) { this.evict(); }
+      at = 0;
+    }
+    while (this.tail < this.head) {
+      const i = this.slot(this.tail);
+      if (this.offset[i] >= at + count || this.offset[i] + this.count[i] <= at) { break; }
+      this.evict();
+    }
+    if (this.head - this.tail === this.capacity) { this.evict(); }
+    this.sampleHead = at + count;
+
+    const n = this.head++;
+    const i = this.slot(n);
+    const start = Number(view.getBigUint64(HEADER.start, true)) / 1000;
+    this.start[i] = start;
+    this.elapsed[i] = view.getUint32(HEADER.elapsed, true) / 1000;
+    this.resolution[i] = view.getUint32(HEADER.resolution, true) / 1000;
+    this.sequence[i] = view.getUint32(HEADER.sequence, true);
+    this.channels[i] = (headerSize > HEADER.channels && view.getUint8(HEADER.channels)) || 1;
+    this.envelope[i] = (flags & FLAG_ENVELOPE) ? 1 : 0;
+    this.fullScale[i] = is12Bit ? 4095 : 255;
+    const analysed = headerSize >= HEADER_ANALYSIS_END;
+    this.clipped[i] = analysed ? view.getUint16(HEADER.clipped, true) / 65535 : NaN;
+    this.peakCount[i] = analysed ? view.getUint8(HEADER.peakCount) : 0;
+    this.offset[i] = at;
+    this.count[i] = count;
+    const bytes = new Uint8Array(buffer, headerSize);
+    if (is12Bit) {
+      unpack12(bytes, count, this.samples, at);
+    } else {
+      this.samples.set(bytes.subarray(0, count), at);
+    }
+
+    if (headerSize >= HEADER_TRIGGERS_END) {
+      const triggers = view.getUint8(HEADER.triggerCount);
+      for (let k = 0; k < triggers; k++) {
+        const points = view.getInt32(HEADER.triggers + 4 * k, true) / TRIGGER_FRACTION;
+        this.addTrigger(n, start + points * this.resolution[i]);
+      }
+    } else if (flags & FLAG_TRIGGERED) {
+      this.addTrigger(n, start + view.getInt32(HEADER.trigOffset, true) / 1000);
+    }
+    return n;
+  }
+
+  addTrigger(n, time) { // Of packet n, at time (ms)
+    if (this.triggerHead - this.triggerTail === this.triggerCapacity) {
+      // Drop the oldest trigger, and the packets before it.
+      const oldest = this.triggerPacket(this.triggerTail);
+      while (this.tail < oldest) { this.evict(); }
+      if (this.triggerHead - this.triggerTail === this.triggerCapacity) { this.triggerTail++; }
+    }
+    const t = this.triggerHead++ % this.triggerCapacity;
+    this.triggerPackets[t] = n;
+    this.triggerTimes[t] = time;
+  }
+}
+const packets = new PacketRing(maxPackets, maxStoredSamples, maxTriggers);
+
+function unpack12(bytes, count, out, at) {
+  /* Unpack 12-bit samples into out from index at. They are stored two per
+  three bytes: [a0-7] [a8-11 | b0-3 << 4] [b4-11] */
+  for (let i = 0, j = 0; i < count; i += 2, j += 3) {
+    out[at + i] = bytes[j] | ((bytes[j + 1] & 0x0F) << 8);
+    if (i + 1 < count) {
+      out[at + i + 1] = (bytes[j + 1] >> 4) | (bytes[j + 2] << 4);
+    }
+  }
+}
+
+function onMessage(event) { // Handle Websocket message
+  if (!(event.data instanceof ArrayBuffer)) {
+    let message = null;
+    try { message = JSON.parse(event.data); } catch (error) { }
+    if (message && message.state) { // The board's state, pushed when it changes
+      postMessage({ type: "state", state: message.state });
+    } else { // Subscription acknowledgement, or stats
+      console.log(`WebSocket: ${event.data}`);
+    }
+    return;
+  }
+  if (event.data.byteLength === ACK_SIZE && new Uint8Array(event.data)[0] === ACK_KIND) {
+    onAck(event.data);
+    return;
+  }
+  const n = packets.store(event.data);
+  if (n < 0) {
+    console.warn("Received packet in an unknown format.");
+    return;
+  }
+  const i = packets.slot(n);
+  const sequence = packets.sequence[i];
+  if (lastSequence >= 0 && sequence > lastSequence + 1) {
+    droppedPackets += sequence - lastSequence - 1;
+  }
+  lastSequence = sequence;
+  if (!Number.isNaN(packets.clipped[i])) { latestAnalysed = n; }
+  requestDisplayUpdate();
+}
+
+// Note that updateDisplay is only called when necessary.
+const updateDisplay = (() => {
+  /* Persistent drawing variables (NOTE 'width' EXCLUDES LEFT MARGIN) */
+  let height, width, leftOffset, underlay, px_per_ms, vOffset;
+
+  dataCtx.globalAlpha = 1;
+
+  // Private helper functions for drawing a packet
+  function spanTo(x, lo, hi, px_per_voltbit, first) {
+    // Path segment covering [lo, hi] in one pixel column
+    if (first) {
+      dataCtx.moveTo(x, lo * px_per_voltbit);
+    } else {
+      dataCtx.lineTo(x, lo * px_per_voltbit);
+    }
+    dataCtx.lineTo(x, hi * px_per_voltbit);
+  }
+
+  function renderPacket(n, trigtime) {
+    // TODO: highlight clipped signals in red.
+    const i = packets.slot(n);
+    const meas = packets.samples;
+    const first = packets.offset[i];
+    const px_per_datapoint = px_per_ms * packets.resolution[i];
+    const offset = px_per_ms * (packets.start[i] - trigtime);
+    const px_per_voltbit = 0.75 * height / packets.fullScale[i];
+    if (phosphor) { // (Which does its own scaling)
+      phosphor.drawPacket(n, trigtime, px_per_voltbit);
+      return;
+    }
+    /* Envelope packets hold a (min, max) pair per point; drawing both at the
+    same x gives a vertical span covering the bin. Channels are interleaved
+    point by point, and each is drawn as its own trace. */
+    const channels = packets.channels[i];
+    const perChannel = packets.envelope[i] ? 2 : 1;
+    const step = perChannel * channels; // Samples per point
+    const points = Math.floor(packets.count[i] / step);
+    // Only points on the hidden canvas (which spans +/- width about the trigger)
+    let pStart = 0;
+    let pEnd = points;
+    if (px_per_datapoint > 0) {
+      pStart = Math.max(pStart, Math.floor((-width - offset) / px_per_datapoint));
+      pEnd = Math.min(pEnd, Math.ceil((width - offset) / px_per_datapoint) + 1);
+    }
+    if (pStart >= pEnd) { return; }
+    /* Zoomed out, many points share each pixel column, so each column is drawn
+    as one span from its lowest to highest sample (an envelope). This keeps the
+    path to a few segments per pixel, however long the packet. Zoomed in, each
+    point is joined by a line. */
+    const dpr = view.dpr; // Device pixels per CSS pixel (the units drawn in)
+    const bucketed = px_per_datapoint * dpr < 1;
+    for (let c = 0; c < channels; c++) {
+      dataCtx.strokeStyle = CHANNEL_COLOURS[c % CHANNEL_COLOURS.length];
+      dataCtx.beginPath();
+      const base = first + c * perChannel;
+      if (!bucketed) {
+        dataCtx.moveTo(offset + pStart * px_per_datapoint, meas[base + pStart * step] * px_per_voltbit);
+        for (let p = pStart; p < pEnd; p++) {
+          const x = offset + p * px_per_datapoint;
+          for (let k = 0; k < perChannel; k++) {
+            dataCtx.lineTo(x, meas[base + p * step + k] * px_per_voltbit);
+          }
+        }
+      } else {
+        let column = Math.floor((offset + pStart * px_per_datapoint) * dpr); // Device pixels
+        let lo = Infinity;
+        let hi = -Infinity;
+        let firstSpan = true;
+        for (let p = pStart; p < pEnd; p++) {
+          const x = Math.floor((offset + p * px_per_datapoint) * dpr);
+          if (x !== column) {
+            spanTo(column / dpr, lo, hi, px_per_voltbit, firstSpan);
+            firstSpan = false;
+            column = x;
+            lo = Infinity;
+            hi = -Infinity;
+          }
+          for (let k = 0; k < perChannel; k++) {
+            const v = meas[base + p * step + k];
+            if (v < lo) { lo = v; }
+            if (v > hi) { hi = v; }
+          }
+        }
+        spanTo(column / dpr, lo, hi, px_per_voltbit, firstSpan);
+      }
+      dataCtx.stroke();
+    }
+  }
+
+  return async () => {
+    if (needsResize) { // Triggered by canvas resize or zoom/dpi change
+      // Resize requires full re-render/draw, so force the corresponding flags.
+      needsDataRender = true;
+      needsReposition = true;
+      // Achieve correct resolution by setting 'drawing width' to pixel width.
+      canvas.width = view.width;
+      canvas.height = view.height;
+      leftOffset = 0.05 * canvas.width; // Space for volt markings
+      height = canvas.height;
+      width = canvas.width - leftOffset;
+      // Set +y to be upwards with origin at the bottom left.
+      ctx.setTransform(1, 0, 0, -1, 0, height);
+      const dpr = view.dpr;
+      ctx.scale(dpr, dpr); /* Handle devicePixelRatio behind-the-scenes, so we
+      can work with CSS pixels instead of device pixels */
+
+      /* RenderingContext2D considers a line to be *centred* at a coordinate, so
+      offset by 0.5px to get clear lines when drawn at integer pixel coordinates.*/
+      ctx.translate(0.5, 0.5);
+      /* The data-rendeing canvas has twice the
+      width, and the centre corresponds with the trigger point. Its origin is
+      set at the middle, vOffset from the top. The vertical axis is *not* flipped, to make it easier to copy it right-way-up to the main canvas. */
+      vOffset = height / 10; // Distance of 0V from the bottom
+      hiddenDataCanvas.width = 2 * width;
+      hiddenDataCanvas.height = 2 * height;
+      dataCtx.setTransform(1, 0, 0, 1, width, vOffset);
+      dataCtx.scale(dpr, dpr);
+      dataCtx.translate(0.5, 0.5);
+      setupPhosphor();
+      if (phosphor) { phosphor.resize(hiddenDataCanvas.width, hiddenDataCanvas.height); }
+
+      /* Now redraw the underlay, and save it so we can use it to overwrite
+      the screen when needed. */
+
+      /* Gridline positions are rounded so they don't alias over multiple 
+      pixels.*/
+      ctx.strokeStyle = "cyan";
+      ctx.beginPath();
+      //  Horizontal
+      const vSpacing = height / 4;
+      for (let i = 0; i < 4; i++) {
+        const y = Math.round(vOffset + i * vSpacing);
+        ctx.moveTo(leftOffset, y);
+        ctx.lineTo(canvas.width, y);
+      }
+      //  Vertical
+      const hSpacing = (width * 0.9) / numDivs;
+      const hOffset = leftOffset + width / 2;
+      for (let i = -numDivs / 2; i <= numDivs / 2; i++) {
+        const x = Math.round(hOffset + i * hSpacing);
+        ctx.moveTo(x, 0);
+        ctx.lineTo(x, height);
+      }
+      ctx.stroke();
+
+      /* Voltage markings. Because I've inverted the y-axis, we also
+      have to invert the text drawing. */
+      ctx.fillStyle = "cyan";
+      ctx.textAlign = "right";
+      ctx.textBaseline = "middle";
+      ctx.font = `${0.6 * leftOffset}px sans-serif`;
+      ctx.save(); // Save un-rotated context
+      ctx.translate(leftOffset, vOffset);
+      ctx.scale(1, -1);
+      for (let i = 0; i < 4; i++) {
+        const y = Math.round(i * vSpacing);
+        // Full scale (4095) is three divisions up.
+        ctx.fillText(calibration ? `${codeVolts(i * 4095 / 3).toFixed(2)}V ` : `${i}V `, 0, -y);
+      }
+      ctx.restore();
+
+      // Save underlay for later
+      //underlay = ctx.getImageData(0, 0, canvas.width, height);
+      underlay = await createImageBitmap(canvas, { imageOrientation: "flipY" });
+      needsResize = false;
+    }
+
+    if (needsDataRender) { // Redraw *all* data to hidden canvas
+      // Re-compute data scale
+      px_per_ms = width / (display.div * numDivs);
+      if (phosphor) { phosphor.setView([width, vOffset], view.dpr, px_per_ms, CHANNEL_COLOURS); }
+
+      // Say all packets/triggers need to be (re)drawn.
+      lastDrawnPacket = -1;
+      lastDrawnTrigger = -1;
+
+      needsDataRender = false;
+    }
+
+    /* Draw all packets waiting to be drawn */
+    dataCtx.lineWidth = display.thick;
+    if (phosphor) { phosphor.upload(); }
+    if (lastDrawnTrigger >= packets.triggerTail) { // There's a previous trigger to draw from.
+      const trigTime = packets.triggerTime(lastDrawnTrigger);
+      // Packet to start from
+      let n = Math.max(lastDrawnPacket, packets.tail);
+      // Packet to draw up to (exclusive) (stops at new trig or end of packets)
+      const stop = (lastDrawnTrigger < packets.triggerHead - 1) ?
+        packets.triggerPacket(lastDrawnTrigger + 1) : packets.head;
+      // Rightmost time on screen
+      const maxTime = trigTime + px_per_ms * width;
+      while (n < stop) {
+        // Continue previous trigger (forwards only)
+        if (packets.start[packets.slot(n)] > maxTime) { break; }
+        renderPacket(n++, trigTime);
+      }
+      lastDrawnPacket = n;
+    }
+    //Any new trigger cycles
+    for (let t = Math.max(lastDrawnTrigger + 1, packets.triggerTail); t < packets.triggerHead; t++) {
+      // Fade previous data
+      if (phosphor) {
+        phosphor.fade(display.persist);
+      } else {
+        dataCtx.fillStyle = `rgba(255,255,255,${display.persist})`;
+        //dataCtx.fillStyle = window.getComputedStyle(canvas).backgroundColor;
+        dataCtx.globalCompositeOperation = "destination-in";
+        dataCtx.fillRect(-width, 0, hiddenDataCanvas.width, height);
+        dataCtx.globalCompositeOperation = "source-over";
+      }
+
+      const trigPacket = packets.triggerPacket(t);
+      const trigTime = packets.triggerTime(t);
+      const minTime = trigTime - px_per_ms * width; // Display bounds
+      const maxTime = trigTime + px_per_ms * width;
+
+      for (let n = trigPacket - 1; n >= packets.tail; n--) { // Draw backwards from trigger point
+        const i = packets.slot(n);
+        if (packets.start[i] + packets.elapsed[i] < minTime) { break; }
+        renderPacket(n, trigTime);
+      }
+      for (let n = trigPacket; n < packets.head; n++) { // Forwards from trigger point (including trigger packet itself)
+        if (packets.start[packets.slot(n)] > maxTime) { break; }
+        renderPacket(n, trigTime);
+        lastDrawnPacket = n;
+      }
+      lastDrawnTrigger = t;
+    }
+
+    const pos = Math.round(leftOffset + display.pos * (width - 1));
+    needsReposition = true;
+    if (needsReposition) {
+      // Clear canvas and redraw underlay
+      ctx.clearRect(0, 0, canvas.width, height);
+      ctx.drawImage(underlay, -0.5, -0.5);
+      // Redraw position indicator
+      const delta = 0.02 * height; // Size of indicator arrow
+      ctx.strokeStyle = "#ffff00";
+      ctx.fillStyle = "#ffff00";
+      ctx.beginPath(); // Main line
+      ctx.moveTo(pos, -1);
+      ctx.lineTo(pos, height + 1);
+      ctx.stroke();
+      ctx.beginPath(); // Top triangle
+      ctx.moveTo(pos - delta, height + 1);
+      ctx.lineTo(pos, height - delta);
+      ctx.lineTo(pos + delta, height + 1);
+      ctx.fill();
+      ctx.beginPath(); // Bottom triangle
+      ctx.moveTo(pos - delta, -1);
+      ctx.lineTo(pos, delta);
+      ctx.lineTo(pos + delta, -1);
+      ctx.fill();
+      needsReposition = false;
+
+      // Finally, in every display update we redraw the data onto the display
+      const data = phosphor ? phosphor.render() : hiddenDataCanvas;
+      ctx.drawImage(data, leftOffset + width - pos, 0, width, height, leftOffset, 0, width, height)
+      /* Necessary to respect transparency */
+    }
+    // Tell the page the latest sweep analysis (at most once a frame).
+    if (latestAnalysed >= packets.tail) {
+      const i = packets.slot(latestAnalysed);
+      postMessage({ type: "sweep", peaks: packets.peakCount[i], clipped: packets.clipped[i] });
+    }
+    latestAnalysed = -1;
+    // Complete.
+    pendingDisplayUpdate = 0;
+  }
+})();
@@ -0,0 +1,36 @@
+"""PlatformIO pre-script: build the filesystem image from a gzipped copy of
+data/, so the web page costs less flash and less airtime to serve.
+
+Web assets (.html, .js, .css, .ico) are stored only as '<name>.gz'; the
+server sends these with 'Content-Encoding: gzip' under the original name.
+Everything else
+(e.g. config.json) is copied unchanged. The copy is made in the build
+directory, so data/ itself stays editable as before.
+"""
+Import("env")
+
+import gzip
+import os
+import shutil
+
+COMPRESSED_TYPES = (".html", ".js", ".css", ".ico")
+
+source_dir = env.subst("$PROJECT_DATA_DIR")
+output_dir = os.path.join(env.subst("$PROJECT_BUILD_DIR"), env.subst("$PIOENV"), "data")
+
+shutil.rmtree(output_dir, ignore_errors=True)
+os.makedirs(output_dir)
+for name in sorted(os.listdir(source_dir)):
+    source = os.path.join(source_dir, name)
+    if not os.path.isfile(source):
+        continue
+    if name.endswith(COMPRESSED_TYPES):
+        with open(source, "rb") as file:
+            content = file.read()
+        with open(os.path.join(output_dir, name + ".gz"), "wb") as file:
+            # mtime=0 makes the output (and so its ETag) depend only on the content.
+            file.write(gzip.compress(content, compresslevel=9, mtime=0))
+    else:
+        shutil.copy2(source, output_dir)
+
+env.Replace(PROJECT_DATA_DIR=output_dir)
@@ -0,0 +1,191 @@
+/* Throughput benchmark of the acquisition pipeline (pipeline.cpp), built for
+the host by the native environment:
+  pio run -e native && .pio/build/native/program
+It plays the part of the acquisition task, feeding frames from a simulated
+ADC (a recorded transmission sweep, with absorption dips and noise) on a
+simulated clock, for each combination of sample width, decimation, capture
+mode and channel count. Per configuration it reports the time per raw reading
+taken into packets, the packet size, and the time to analyse a packet and to
+encode a reduced copy for a subscriber. Times are the host's, so compare runs
+on the same machine rather than with the board. */
+
+#include "../pipeline.h"
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+const unsigned int bench_capacity = 1 << 16; // Samples per packet (cf. packet_capacity)
+const unsigned int bench_packets = 200;      // Packets per configuration
+const unsigned int sweep_period = 20000;     // Simulated sweep (and trigger) period (microseconds)
+const unsigned int subscriber_decimate = 4;  // Reduced stream encoded per packet
+
+/* Simulated ADC: a table of frames covering one sweep at the current
+resolution, replayed in a loop, so making readings costs next to nothing
+beside the pipeline itself. */
+std::vector<uint16_t> adc_table;
+unsigned int adc_frames = 0;
+uint64_t fake_clock = 0; // Microseconds (cf. esp_timer_get_time)
+
+void recordSweep() {
+  uint32_t noise = 12345; // xorshift
+  adc_frames = sweep_period / time_resolution;
+  adc_table.assign(adc_frames * channel_count, 0);
+  for (unsigned int i = 0; i < adc_frames; i++) {
+    const float x = (float)i / adc_frames; // Position in the sweep
+    for (unsigned int c = 0; c < channel_count; c++) {
+      noise ^= noise << 13;
+      noise ^= noise >> 17;
+      noise ^= noise << 5;
+      // Transmission falls with the laser power ramp, with two Lorentzian dips.
+      float v = 3200 - 1200 * x;
+      v -= 900 / (1 + powf((x - 0.35f) / 0.01f, 2));
+      v -= 500 / (1 + powf((x - 0.62f) / 0.015f, 2));
+      v += (float)(noise % 17) - 8 + 150 * c;
+      adc_table[i * channel_count + c] = (uint16_t)std::min(std::max(v, 0.0f), 4095.0f);
+    }
+  }
+}
+
+struct Result {
+  double ns_per_sample;  // Per raw reading, taking frames into packets
+  size_t packet_bytes;
+  double analyse_us;     // Per packet
+  double encode_us;      // Per packet
+};
+
+Result run(unsigned int resolution, unsigned int duration, unsigned int channels, uint8_t bits,
+    Decimation d, unsigned int points, CaptureMode capture) {
+  using clock = std::chrono::steady_clock;
+  channel_count = channels;
+  time_resolution = resolution;
+  sample_bits = bits;
+  decimation = d;
+  capture_mode = capture;
+  pretrigger = 0.5;
+  recordSweep();
+  fake_clock = 0;
+  stream_start = 0;
+  trigger_tail = trigger_head;
+  planPacket(duration, points, bench_capacity);
+  std::vector<uint8_t> packet(sizeof(PacketHeader) + sampleBytes(packet_samples));
+  std::vector<uint8_t> reduced(packet.size()); // (Reductions are never larger)
+  input_buffer = packet.data() + sizeof(PacketHeader);
+
+  clock::duration taking{}, analysing{}, encoding{};
+  uint64_t readings = 0;
+  unsigned int frame = 0;
+  uint64_t next_trigger = 0;
+  for (unsigned int n = 0; n < bench_packets; n++) {
+    resetPacket(fake_clock);
+    const clock::time_point begin = clock::now();
+    while (!packetFull()) {
+      if (capture == CAPTURE_TRIGGERED && fake_clock >= next_trigger) { // (The ISR's job)
+        const unsigned int head = trigger_head;
+        trigger_ring[head % trigger_ring_size] = stream_start + next_trigger;
+        trigger_head = head + 1;
+        next_trigger += sweep_period;
+      }
+      takeFrame(&adc_table[frame * channel_count]);
+      if (++frame == adc_frames) { frame = 0; }
+      fake_clock += time_resolution;
+      readings += channel_count;
+    }
+    flushBin();
+    const clock::time_point taken = clock::now();
+    PacketHeader header = packetHeader((uint64_t)time_resolution * n_raw);
+    analyseSweep(header, input_buffer);
+    memcpy(packet.data(), &header, sizeof(header));
+    const clock::time_point analysed = clock::now();
+    encodeReduced(packet.data(), subscriber_decimate, 8, reduced.data());
+    const clock::time_point encoded = clock::now();
+    taking += taken - begin;
+    analysing += analysed - taken;
+    encoding += encoded - analysed;
+  }
+  const auto ns = [](clock::duration t) { return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(t).count(); };
+  return {ns(taking) / readings, packet.size(), ns(analysing) / 1000 / bench_packets, ns(encoding) / 1000 / bench_packets};
+}
+
+bool checkRebaseTrigger(unsigned int after) {
+  /* Check a trigger arriving 'after' frames after armedFrame rebases (waiting
+  a whole pre-trigger ring), so the pre-trigger window reaches back past the
+  rebase. The capture must start pretrigger_samples frames before the trigger,
+  on the stream's schedule. */
+  channel_count = 1;
+  time_resolution = 2;
+  sample_bits = 8;
+  decimation = DECIMATE_NONE;
+  capture_mode = CAPTURE_TRIGGERED;
+  pretrigger = 0.5;
+  stream_start = 1000;
+  trigger_tail = trigger_head;
+  planPacket(40000, 1000, bench_capacity);
+  std::vector<uint8_t> packet(sizeof(PacketHeader) + sampleBytes(packet_samples));
+  input_buffer = packet.data() + sizeof(PacketHeader);
+  resetPacket(stream_start);
+  const int64_t trigger_frame = pretrigger_frames + after;
+  const uint16_t frame[max_channels] = {2048};
+  for (int64_t f = 0; f <= trigger_frame && capture_state == ARMED; f++) {
+    if (f == trigger_frame) {
+      const unsigned int head = trigger_head;
+      trigger_ring[head % trigger_ring_size] = stream_start + trigger_frame * time_resolution;
+      trigger_head = head + 1;
+    }
+    takeFrame(frame);
+  }
+  const int64_t expected = trigger_frame - pretrigger_samples + 1;
+  const bool ok = capture_state == CAPTURING && packet_frame == expected &&
+    packet_start == stream_start + (uint64_t)(expected * time_resolution);
+  if (!ok) {
+    printf("Trigger %u frames after a rebase: packet_frame %lld (expected %lld), packet_start %llu\n", after,
+      (long long)packet_frame, (long long)expected, (unsigned long long)packet_start);
+  }
+  return ok;
+}
+
+int main() {
+  pretrigger_capacity = bench_capacity;
+  std::vector<uint16_t> pretrigger_storage(pretrigger_capacity);
+  pretrigger_buffer = pretrigger_storage.data();
+
+  // Correctness checks first, so a broken pipeline isn't benchmarked.
+  for (const unsigned int after : {0u, 1u, 10u, 9999u, 10000u, 70000u}) {
+    if (!checkRebaseTrigger(after)) { return 1; }
+  }
+
+  struct Mode {
+    const char *name;
+    uint8_t bits;
+    Decimation decimation;
+  };
+  const Mode modes[] = {
+    {"8-bit", 8, DECIMATE_NONE},
+    {"12-bit", 12, DECIMATE_NONE},
+    {"8-bit average", 8, DECIMATE_AVERAGE},
+    {"12-bit average", 12, DECIMATE_AVERAGE},
+    {"8-bit min/max", 8, DECIMATE_ENVELOPE},
+    {"12-bit min/max", 12, DECIMATE_ENVELOPE},
+  };
+  const unsigned int channel_counts[] = {1, 4};
+  const CaptureMode captures[] = {CAPTURE_CONTINUOUS, CAPTURE_TRIGGERED};
+
+  // As DMA at 2us per channel, over a 40ms sweep, to a 1000-point display.
+  printf("%-16s %-10s %3s %12s %13s %14s %13s\n",
+    "mode", "capture", "ch", "ns/sample", "bytes/packet", "analyse_us", "encode_us");
+  for (const Mode &mode : modes) {
+    if (fixed_sample_bits && mode.bits != fixed_sample_bits) { continue; } // (Not in this profile)
+    for (const CaptureMode capture : captures) {
+      for (const unsigned int channels : channel_counts) {
+        if (channels > (unsigned int)max_channels) { continue; }
+        const Result r = run(2 * channels, 40000, channels, mode.bits, mode.decimation, 1000, capture);
+        printf("%-16s %-10s %3u %12.2f %13zu %14.1f %13.1f\n", mode.name,
+          (capture == CAPTURE_TRIGGERED) ? "triggered" : "continuous", channels,
+          r.ns_per_sample, r.packet_bytes, r.analyse_us, r.encode_us);
+      }
+    }
+  }
+  return 0;
+}
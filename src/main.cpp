@@ -9,53 +9,1723 @@ MOGLabs Diode Laser Controller
 #include <LittleFS.h>    // File-system
 // https://github.com/me-no-dev/ESPAsyncWebServer
 #include <ArduinoJSON.h> // https://arduinojson.org/
-#include <AsyncJson.h>   // For handling JSON packets
 #include <ESPAsyncWebServer.h>
+#include <driver/i2s.h>  // I2S peripheral, used for DMA sampling of the ADC
+#include <soc/syscon_struct.h> // ADC pattern table, for multi-channel DMA
+#include <soc/sens_struct.h> // SAR ADC registers, for timer-driven sampling
+#include <esp_adc_cal.h> // ADC calibration (from eFuse)
+#include <esp_timer.h>   // 64-bit microsecond clock
+#include <esp_heap_caps.h> // Internal RAM and PSRAM sizes, for the packet arena
+#include <rom/crc.h>     // CRC32 (in ROM), for ETags
+#include <atomic>
+#include <memory>      // shared_ptr, for state kept between chunks of a response
+#include "profile.h"   // Build profile: limits and pins fixed at compile time
+#include "pipeline.h"  // Packet format, decimation, capture and analysis
 
 // ON ESP32 board, pins 16-33 are all good.
 
-// Pin mappings
+// Pin mappings (set by the build profile)
 /* ESP32 has 2 ADC pins. When WiFi is in use, only ADC1 pins (not ADC2 pins) can be used. */
-const int LED_PIN = 2; // LED pin is inverted: LOW is on and HIGH is off.
-const int TRIG_PIN = 14;
-const int SLOW_LOCK_PIN = 23;
-const int FAST_LOCK_PIN = 22;
-const int INPUT_PIN = 34;
-const int PZT_DAC_PIN = 26;
+const int LED_PIN = PROFILE_LED_PIN; // LED pin is inverted: LOW is on and HIGH is off.
+const int TRIG_PIN = PROFILE_TRIG_PIN;
+const int SLOW_LOCK_PIN = PROFILE_SLOW_LOCK_PIN;
+const int FAST_LOCK_PIN = PROFILE_FAST_LOCK_PIN;
+const int INPUT_PIN = PROFILE_INPUT_PIN;
+const int PZT_DAC_PIN = PROFILE_PZT_DAC_PIN;
+
+/* Input channels. Up to max_channels ADC1 pins are sampled on one timebase:
+each sample time takes a reading from every channel (a 'frame'), and packets
+hold frames interleaved, in the order the channels are listed. INPUT_PIN is
+the default (and by default the only) channel. Sweep analysis and auto-relock
+use the first channel. Like other settings, changes wait for a new packet. */
+int channel_pins[max_channels] = {INPUT_PIN};
+adc1_channel_t channel_adc[max_channels]; // ADC1 channel of each pin (set on use)
+
+int adc1Channel(int pin) {
+  /* ADC1 channel of a pin, or -1 if it has none. The I2S (DMA) driver
+  addresses the ADC by channel rather than by pin. */
+  switch (pin) {
+  case 36: return ADC1_CHANNEL_0;
+  case 37: return ADC1_CHANNEL_1;
+  case 38: return ADC1_CHANNEL_2;
+  case 39: return ADC1_CHANNEL_3;
+  case 32: return ADC1_CHANNEL_4;
+  case 33: return ADC1_CHANNEL_5;
+  case 34: return ADC1_CHANNEL_6;
+  case 35: return ADC1_CHANNEL_7;
+  default: return -1;
+  }
+}
 
 // Trigger state (Note 'HIGH' and 'LOW' are just aliases for '1' and '0')
 bool trig = LOW;
-bool slow_lock = false;
-bool fast_lock = false;
+// (Set by both the web server and the auto-relock controller)
+std::atomic<bool> slow_lock(false);
+std::atomic<bool> fast_lock(false);
+
+/* PZT offset slewing. Rather than jumping to each offset asked for, which
+sends the laser frequency jumping when the slider is dragged quickly, the
+output moves towards the latest target at pzt_slew_rate, in steps from a
+periodic esp_timer that only runs while the output is moving. Targets
+arriving faster than it can follow just replace one another, so a burst of
+slider messages costs no DAC writes of its own. */
+uint8_t pzt_offset = 255; // Last value written to PZT_DAC_PIN (by the slew timer)
+std::atomic<int> pzt_target(255); // Where the output is heading
+float pzt_position = 255;         // Output between DAC steps (slew timer's)
+float pzt_slew_rate = 500;        // DAC steps per second (0 to jump)
+const uint64_t pzt_step_interval = 1000; // Microseconds between slew steps
+esp_timer_handle_t pzt_timer = nullptr;
 
 /*
 Also note that all *external inputs* (config file, client) for resolution and
 duration are in milliseconds, but internally microseconds are used as the
-millis() function only goes to millisecond precision.
+millis() function only goes to millisecond precision. Times come from
+esp_timer_get_time() rather than micros(), which is 32-bit and rolls over
+after ~70 minutes; packets are scheduled back-to-back, which breaks at a rollover.
 */
-const int buffer_size = 4096; // TODO: choose buffer size.
-uint8_t input_buffer[buffer_size];
+/* Packet memory. Rather than being fixed, the packet capacity is chosen at
+boot from the memory free (see setupArena), so boards with PSRAM (e.g.
+WROVER) can hold far longer packets. The budget covers the ring slots, the
+reduced copies for subscribers, and the pre-trigger buffer. arena_headroom of
+internal RAM is left for WiFi, TCP and the web server. Undecimated packets
+longer than the capacity are cut short, and flagged as such. */
+unsigned int packet_capacity = 4096; // Max samples per packet
+const unsigned int min_packet_capacity = 4096;
+const unsigned int max_packet_capacity = PROFILE_MAX_PACKET_CAPACITY;
+const size_t arena_headroom = 96 * 1024; // Bytes of internal RAM kept free
+bool arena_psram = false; // Whether the arena is in PSRAM
+
+/* Packet ring. Each slot is a WebSocket message buffer which acquisition
+writes into directly. A finished slot is handed to the WebSocket layer by
+pointer (no copy), which holds a reference on it for each client until that
+client has sent it; only then is the slot reused. Meanwhile acquisition moves
+straight on to the next free slot, so sending never holds up sampling. */
+const int ring_size = PROFILE_RING_SIZE; // Must be a power of 2 (for SpscQueue).
+AsyncWebSocketMessageBuffer *ring[ring_size];
+int fill_slot = 0;       // Slot currently being written by acquisition (input_buffer)
+/* If a slot can't be resized for a packet (the heap being short or
+fragmented), the packet is taken into fallback_packet instead, cut to
+min_packet_capacity samples: it is still analysed (so relocking carries on),
+but it is dropped rather than sent, and the slot is tried again next time. */
+uint8_t fallback_packet[sizeof(PacketHeader) + min_packet_capacity * 3 / 2 + 1];
+bool packet_fallback = false; // Whether the current packet is in fallback_packet
+std::atomic<unsigned int> allocation_failures(0); // Slots and encode buffers that couldn't be resized
+std::atomic<unsigned int> dropped_packets(0); // Packets never sent
+
+/* Lock-free single-producer, single-consumer queue. Safe for one task to
+push while another pops, without locking: head is only written by the
+consumer and tail only by the producer. Indices run freely and wrap
+consistently because Size is a power of 2. */
+template <typename T, unsigned int Size>
+class SpscQueue {
+  static_assert((Size & (Size - 1)) == 0, "Size must be a power of 2");
+  T items[Size];
+  std::atomic<unsigned int> head{0}; // Next item to pop
+  std::atomic<unsigned int> tail{0}; // Next free position to push to
+public:
+  bool push(const T &item) { // Returns false if full.
+    const unsigned int t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == Size) { return false; }
+    items[t % Size] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+  bool pop(T &item) { // Returns false if empty.
+    const unsigned int h = head.load(std::memory_order_relaxed);
+    if (tail.load(std::memory_order_acquire) == h) { return false; }
+    item = items[h % Size];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+uint32_t packet_sequence = 0;
+
+// A finished packet, passed from acquisition to streaming.
+struct PacketDescriptor {
+  int slot;            // Ring slot holding the samples
+  uint64_t elapsed;    // Packet length (microseconds)
+};
+
+/* Slots circulate between the two tasks: acquisition takes a free slot,
+fills it and passes it on in packet_queue; streaming sends it and returns it
+through free_queue once the WebSocket layer is finished with it. */
+SpscQueue<PacketDescriptor, ring_size> packet_queue; // Acquisition -> streaming
+SpscQueue<int, ring_size> free_queue;                // Streaming -> acquisition
+
+/* Tasks. Acquisition has a core to itself, at high priority. Streaming
+shares core 0 with WiFi and the async TCP task, which do the actual sending. */
+TaskHandle_t acquisition_task;
+TaskHandle_t streaming_task;
+const BaseType_t acquisition_core = 1;
+const BaseType_t streaming_core = 0;
+const UBaseType_t acquisition_priority = configMAX_PRIORITIES - 5;
+const UBaseType_t streaming_priority = 3; // Same as async TCP task.
+
+/* Acquisition modes:
+- POLLED: a hardware timer interrupt starts each conversion on schedule and
+  collects it on the next tick, and the acquisition task takes the queued
+  frames in batches. Limited to ~50kS/s, but the timing doesn't depend on
+  when the task gets the CPU.
+- DMA: the I2S peripheral clocks the ADC and writes samples to memory by
+  itself, at a fixed rate of up to several hundred kS/s. The acquisition task
+  just collects the finished blocks.
+Like resolution, a mode change waits until the start of a new packet. */
+enum SampleMode { POLLED, DMA };
+SampleMode sample_mode = POLLED;
+
+PacketHeader latest_header = {}; // Most recent packet sent, for /status
+char laser_name[100] = ""; // From the config file
+// Guards latest_header, which the async TCP task reads while acquisition writes.
+portMUX_TYPE latest_header_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Auto-relock. When enabled, the acquisition task watches the sweep analysis
+of every packet while both locks are on, and relocks without waiting for a
+browser:
+- RELOCK_MONITOR: while locked the DLC holds the laser still, so the signal
+  stays within relock_range; several packets in a row outside it (or
+  clipping) mean the lock has been lost.
+- RELOCK_SEARCH: both locks are dropped, so the DLC sweeps again, and the
+  PZT offset is servoed to bring the deepest peak onto the trigger (the DLC
+  locks to the nearest zero-crossing to the trigger point).
+- RELOCK_ENGAGE_SLOW, RELOCK_ENGAGE_FAST: the locks are re-engaged in turn,
+  a few packets apart, then monitoring resumes.
+After relock_max_attempts failures without holding the lock for long, or a
+search that doesn't converge, it gives up (RELOCK_FAILED) until the locks are
+next switched on. Any manual lock command or frequency offset change while
+relocking hands control back (RELOCK_IDLE). Relocking needs continuous
+packets, so acquisition keeps running without any clients while enabled. */
+enum RelockState { RELOCK_OFF, RELOCK_IDLE, RELOCK_MONITOR, RELOCK_SEARCH,
+  RELOCK_ENGAGE_SLOW, RELOCK_ENGAGE_FAST, RELOCK_FAILED };
+std::atomic<RelockState> relock_state(RELOCK_OFF);
+std::atomic<bool> relock_enabled(false);
+std::atomic<bool> relock_cancel(false); // Set by manual commands
+// Tuning (from the config file)
+float relock_gain = 1.0;         // PZT DAC counts per ms of peak error (sign sets direction)
+unsigned int relock_range = 400; // Max signal range while locked (12-bit ADC counts)
+float relock_tolerance = 0.5;    // Peak to trigger distance to relock at (ms)
+const uint16_t relock_clip = 0xFFFF / 20; // Clipped fraction meaning unlocked
+const unsigned int relock_unlock_packets = 3; // Unlocked packets in a row to act on
+const unsigned int relock_settle_packets = 2; // Between engaging each lock
+const unsigned int relock_centred_packets = 2; // Centred sweeps in a row to lock at
+const unsigned int relock_max_search = 100;    // Sweeps before giving up a search
+const unsigned int relock_max_attempts = 3;
+const unsigned int relock_hold_packets = 100;  // Locked packets to count a success
+const int relock_max_step = 8;   // Largest PZT change per sweep (DAC counts)
+unsigned int relock_attempts = 0;
+
+/* Low-power idle. With nobody to sample for (no WebSocket clients or live
+export), the acquisition task stops sampling, drops the CPU clock to
+idle_cpu_mhz and lets WiFi sleep through several beacons at a time (rather
+than waking for each, as usual), then blocks until wakeAcquisition() (a client
+connecting, or relocking or an export starting). Full speed returns before
+the next packet starts. The history and the lock watchdog only need a packet
+now and then, so meanwhile acquisition wakes for one packet per interval,
+idling in between: every history_interval for the history (which only keeps
+one per interval anyway), and every idle_relock_interval for relocking,
+except while actually relocking. With idle_relock_interval 0, relocking keeps
+the board at full rate; otherwise its packet counts (e.g.
+relock_unlock_packets) span longer. */
+const uint32_t idle_cpu_mhz = 80; // Lowest that keeps the 80MHz APB clock (timers, I2S)
+uint32_t active_cpu_mhz = 240;    // (Set at boot)
+unsigned int idle_relock_interval = 0; // Milliseconds; 0 keeps the watchdog at full rate
+bool idling = false;
+uint32_t finished_packets = 0; // Acquired, whether or not sent
+
+/* Adaptive rate control. The streaming task watches for backpressure:
+packets dropped because the ring was full, or sends taking more than two
+packet periods. On congestion it raises
+congestion_level, then waits a few packets for that to take effect; once
+sends are quick again it lowers the level one step at a time. Each level
+first halves the points per decimated packet (down to 1/8), then halves the
+packet rate (down to 1/16) by skipping packets in acquisition. */
+std::atomic<unsigned int> congestion_level(0);
+const unsigned int max_point_shift = 3;
+const unsigned int max_rate_shift = 4;
+unsigned int effective_points = 0;   // Points per packet after rate control
+unsigned int rate_divider = 1;       // Send one packet in every rate_divider
+unsigned int rate_count = 0;         // Packets skipped since the last one sent
+// Statistics, updated by the streaming task
+float send_latency = 0;    // Smoothed time to send a packet (microseconds)
+float packet_rate = 0;     // Packets sent per second
+unsigned int queued_messages = 0; // Messages still queued, summed over clients
+
+/* Instrumentation, to tell whether the board is keeping up. The hot path
+times its stages (with the CPU cycle counter, or esp_timer across tasks) into
+histograms with power-of-2 bounds: a value goes in the first bucket whose
+bound 2^k is at least the value, and the last bucket takes anything larger.
+Each histogram is written by one task and read by the async TCP task, for
+/metrics (in Prometheus text format) and the WebSocket stats (see
+Subscription). Recording is a few instructions under the histogram's own
+spinlock, so a reader never sees the buckets and sum out of step. */
+const unsigned int histogram_buckets = 22; // Bounds 1, 2, 4 ... 2^20, then +Inf
+struct Histogram {
+  uint32_t counts[histogram_buckets] = {};
+  uint64_t sum = 0;
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+  inline void record(uint32_t value) {
+    const unsigned int k = (value <= 1) ? 0 : min(32u - __builtin_clz(value - 1), histogram_buckets - 1);
+    portENTER_CRITICAL(&lock);
+    counts[k]++;
+    sum += value;
+    portEXIT_CRITICAL(&lock);
+  }
+  void read(uint32_t *out, uint64_t *out_sum) {
+    portENTER_CRITICAL(&lock);
+    memcpy(out, counts, sizeof(counts));
+    if (out_sum) { *out_sum = sum; }
+    portEXIT_CRITICAL(&lock);
+  }
+};
+// Times in microseconds
+Histogram sample_jitter;   // Polled samples: time taken after their deadline (acquisition)
+Histogram finish_time;     // Finishing a packet: analysis, relock and hand-over (acquisition)
+Histogram encode_time;     // Each reduced encoding (streaming)
+Histogram send_time;       // Queueing a packet to every client due it (streaming)
+Histogram delivery_time;   // From hand-over until every client has sent it (streaming)
+Histogram packet_gap;      // Between packets reaching the streaming task
+Histogram queue_depth;     // Messages queued to clients, as each packet arrives (messages)
+std::atomic<unsigned int> packets_sent(0);    // Packets sent to at least one client
+std::atomic<unsigned int> client_skips(0);    // Packets a client missed, its queue being full
+std::atomic<unsigned int> encode_shortages(0); // Packets a client missed, with no free encode buffer
+uint32_t cycles_per_us = 240; // CPU clock (set at boot)
+
+inline uint32_t microsSince(uint32_t cycles) {
+  // Time since an ESP.getCycleCount() reading (which wraps every ~18s).
+  return (ESP.getCycleCount() - cycles) / cycles_per_us;
+}
+
+uint32_t recentQuantile(Histogram &h, uint32_t *last, float q) {
+  /* Upper bound of the bucket holding quantile q of the values recorded
+  since the last call with the same last[] (0 if none were). */
+  uint32_t counts[histogram_buckets];
+  h.read(counts, nullptr);
+  uint32_t total = 0;
+  for (unsigned int k = 0; k < histogram_buckets; k++) {
+    const uint32_t n = counts[k] - last[k];
+    last[k] = counts[k];
+    counts[k] = n;
+    total += n;
+  }
+  if (total == 0) { return 0; }
+  uint32_t seen = 0;
+  for (unsigned int k = 0; k < histogram_buckets; k++) {
+    seen += counts[k];
+    if (seen >= q * total) { return 1u << k; }
+  }
+  return 1u << (histogram_buckets - 1);
+}
+
+/* Sampling settings. Changes take effect from the next packet, since a
+packet's length is fixed when it starts. The web server (and setup) change a
+copy of pending_settings and publish it whole, under settings_lock (see
+setSampleSettings), and acquisition takes a snapshot at each packet boundary
+(see startPacket), so it never sees half a change, nor one mid-packet. */
+struct SampleSettings {
+  SampleMode mode;
+  unsigned int resolution;    // Microseconds
+  unsigned int duration;      // Microseconds
+  uint8_t bits;               // See sample_bits.
+  unsigned int channel_count; // See Input channels.
+  int channel_pins[max_channels];
+  Decimation decimation;
+  unsigned int points;        // Bins per packet requested by the client
+  CaptureMode capture;
+  double pretrigger;          // See pretrigger.
+};
+SampleSettings pending_settings = {POLLED, 2000, 40000, (uint8_t)(fixed_sample_bits ? fixed_sample_bits : 8),
+  1, {INPUT_PIN}, DECIMATE_NONE, 1000, CAPTURE_CONTINUOUS, 0.5};
+SampleSettings packet_settings = pending_settings; // The current packet's (acquisition's own)
+portMUX_TYPE settings_lock = portMUX_INITIALIZER_UNLOCKED;
+
+SampleSettings pendingSettings() {
+  portENTER_CRITICAL(&settings_lock);
+  const SampleSettings pending = pending_settings;
+  portEXIT_CRITICAL(&settings_lock);
+  return pending;
+}
+
+// Resolution limits (microseconds) for each mode, per channel sampled.
+const unsigned int polled_min_resolution = 20; // i.e. 50kS/s
+const unsigned int dma_min_resolution = 2;     // i.e. 500kS/s
+
+/* ADC calibration. Each chip's ADC is a little different (its reference
+voltage is measured in the factory and kept in eFuse), and at 11dB it isn't
+linear near the top of its range. esp_adc_cal characterises ADC1 once at boot,
+and the voltage of every code is tabulated, so converting is a lookup.
+Packets still carry raw codes, which pack smaller; clients convert them with
+the table from /calibration, which is sampled every calibration_step codes. */
+const uint32_t adc_default_vref = 1100; // mV, for chips without an eFuse reference
+const unsigned int calibration_step = 65; // 4095 = 63 * 65
+esp_adc_cal_value_t adc_calibration_source;
+uint16_t adc_millivolts[4096]; // Volts (mV) of each 12-bit code
+bool polled_adc_ready = false; // Whether the channels in use have been set up for polling
+
+// DMA acquisition
+const i2s_port_t ADC_I2S_PORT = I2S_NUM_0; // Only I2S0 can read the ADC.
+const int dma_buf_count = 8;   // Number of DMA buffers in the driver's queue
+const int dma_buf_len = 512;   // Samples per DMA buffer
+uint16_t dma_buffer[dma_buf_len]; // Block most recently read from the driver
+uint16_t dma_frame[max_channels];   // Frame being assembled from the DMA stream
+unsigned int dma_frame_mask = 0;    // Channels of dma_frame filled so far
+uint8_t dma_channel_index[16];      // Position in the frame of each ADC channel
+bool dma_running = false;
 
-unsigned int time_resolution = 2000;  // Microseconds
-unsigned int next_resolution = 2000;  // Pending resolution.
-unsigned int sample_duration = 40000; // Microseconds
+/* Polled acquisition. A hardware timer ticks once per channel per frame. Each
+tick collects the conversion started by the previous one and starts the next
+(through the SAR registers directly, since the ADC driver takes a lock, which
+an interrupt can't), so the interrupt never waits for the ADC and readings are
+taken on the timer's schedule rather than the task's. Finished frames queue in
+timer_frames, and the acquisition task is woken for each batch (~1ms) of them,
+leaving the core free in between. If the task falls a whole queue behind, the
+interrupt stops queueing and the packet is restarted. */
+const uint8_t sample_timer_number = 0;
+const unsigned int timer_queue_size = 256; // Frames; must be a power of 2
+struct TimerFrame {
+  uint16_t raw[max_channels];
+  uint16_t lateness; // Start of its first conversion after the deadline (microseconds)
+};
+TimerFrame timer_frames[timer_queue_size];
+std::atomic<unsigned int> timer_head(0); // Frames queued (by the interrupt)
+std::atomic<unsigned int> timer_tail(0); // Frames taken (by acquisition)
+std::atomic<bool> timer_overrun(false);
+hw_timer_t *sample_timer = nullptr;
+bool timer_running = false;
+/* Interrupt state, set up before the timer starts. The interrupt must not
+call out of IRAM (flash is unavailable during LittleFS writes), so it keeps
+running counts rather than dividing or multiplying, and clamps by hand. */
+TimerFrame timer_frame;          // Being filled
+unsigned int timer_channel = 0;  // Of the conversion in progress
+unsigned int timer_batch = 1;    // Frames per wake-up of acquisition
+unsigned int timer_batched = 0;  // Frames queued since the last wake-up
+unsigned int timer_tick = 1;     // Tick period (microseconds)
+uint64_t timer_start = 0;        // When the first conversion started
+uint64_t timer_deadline = 0;     // When the current tick was due
 
-uint64_t packet_start;  // Packet start time (microseconds);
 uint64_t elapsed = 0;   // Since start of packet (microseconds)
-unsigned int N = 0;     // Datapoint in current packet
-uint64_t trig_time = 0; // Most recent trigger time (microseconds)
 
 // Create AsyncWebServer object on port 80
 AsyncWebServer server(80);
 AsyncWebSocket ws("/ws");
 
+/* Static web assets. The filesystem image holds these gzipped (see
+scripts/compress_data.py), and they are sent as stored, with
+'Content-Encoding: gzip'. Each has an ETag from the CRC of its contents, so a
+browser reopening the page only needs a 304 (Not Modified) reply per file,
+rather than the files themselves competing with the sample stream.
+Browsers must still revalidate ('no-cache'), as the files keep the same URLs
+when the filesystem is re-uploaded. */
+struct StaticAsset {
+  String path;   // As requested, without the .gz
+  char etag[11]; // Quoted hex CRC32
+};
+const int max_static_assets = 8;
+StaticAsset static_assets[max_static_assets];
+int static_asset_count = 0;
+const char *static_cache_control = "no-cache";
+
+uint32_t fileCrc(File &file) {
+  uint8_t chunk[256];
+  uint32_t crc = 0;
+  size_t n;
+  while ((n = file.read(chunk, sizeof(chunk))) > 0) {
+    crc = crc32_le(crc, chunk, n);
+  }
+  return crc;
+}
+
+void loadStaticAssets() {
+  // Find the gzipped files in the filesystem's root, and hash each.
+  File root = LittleFS.open("/");
+  for (File file = root.openNextFile(); file && static_asset_count < max_static_assets;
+      file = root.openNextFile()) {
+    const String name = file.path();
+    if (file.isDirectory() || !name.endsWith(".gz")) { continue; }
+    StaticAsset &asset = static_assets[static_asset_count++];
+    asset.path = name.substring(0, name.length() - 3);
+    snprintf(asset.etag, sizeof(asset.etag), "\"%08x\"", fileCrc(file));
+  }
+}
+
+void serveStaticAsset(AsyncWebServerRequest *request, const StaticAsset &asset) {
+  AsyncWebServerResponse *response;
+  if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == asset.etag) {
+    response = request->beginResponse(304); // Browser's copy is current.
+  } else {
+    // Given the original name, this finds the .gz and sets Content-Encoding.
+    response = request->beginResponse(LittleFS, asset.path);
+  }
+  response->addHeader("ETag", asset.etag);
+  response->addHeader("Cache-Control", static_cache_control);
+  request->send(response);
+}
+
+/* Stream subscriptions. Rather than every client getting every packet, each
+client subscribes to a reduced stream suited to its link: the streaming task
+combines each 'decimate' points into one (averaging, or merging min/max
+pairs), cuts samples to 'bits', and sends no more than max_rate packets per
+second. Each distinct reduction is encoded once per packet and shared by the
+clients that asked for it, and each client is sent to individually, so a
+client whose queue is full just misses packets without holding up the others.
+Clients get the full stream until they subscribe, by sending
+  {"subscribe": {"decimate": 4, "max_rate": 10, "bits": 8}}
+as a text message (any field can be left out), to which the reply is the
+subscription as applied, as {"subscribed": {...}}. Adding "stats": true also
+gets it a summary of the instrumentation once a second, as {"stats": {...}}. */
+struct Subscription {
+  uint32_t client_id;     // 0 if unused (client ids start at 1)
+  unsigned int decimate;  // Points combined into each point sent
+  float max_rate;         // Packets per second (0 for no limit)
+  uint8_t bits;           // Sample width (no more than acquired)
+  uint64_t last_sent;     // Schedule for max_rate (microseconds)
+  bool stats;             // Whether to send the stats summary
+};
+const int max_subscriptions = 8; // ESPAsyncWebServer's DEFAULT_MAX_WS_CLIENTS
+const unsigned int max_subscription_decimate = 64;
+Subscription subscriptions[max_subscriptions] = {};
+// Guards subscriptions, which the async TCP task changes while streaming reads.
+portMUX_TYPE subscriptions_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Buffers for reduced streams, owned by the streaming task. Like ring slots,
+each is only reused once the WebSocket layer has finished with it; if none is
+free, clients needing a new encoding miss that packet. Full-stream clients
+are sent the ring slot itself, so they still cost no copy. */
+const int encode_pool_size = 8;
+AsyncWebSocketMessageBuffer *encode_pool[encode_pool_size] = {};
+
+/* Rolling history, so what happened while nobody was watching (e.g. the lock
+overnight) can be looked back on. Every history_interval, the streaming task
+keeps a reduced copy of a packet: its header (with the sweep analysis) and at
+most history_samples 8-bit samples (shared between channels). Records are stored in the binary packet
+format, one per fixed-size slot, in RAM (from the arena) or, if
+history_file_records is set, in a ring file on LittleFS, which holds more but
+is cleared at boot. /history?from=&to=&decimate= streams the records in a time
+range back to back, as the WebSocket would have sent them. */
+const unsigned int history_samples = 256;
+const size_t history_stride = sizeof(PacketHeader) + history_samples; // Bytes per slot
+const size_t history_internal_bytes = 24 * 1024;
+const size_t history_psram_bytes = 1024 * 1024;
+const char *history_path = "/history.bin";
+unsigned int history_interval = 1000; // Milliseconds between records
+unsigned int history_capacity = 0;    // Records held (0 if there is no history)
+unsigned int history_file_records = 0; // Capacity of the ring file (0 to use RAM)
+uint8_t *history_buffer = nullptr;     // RAM slots
+File history_file;
+std::atomic<uint32_t> history_written(0); // Records written so far; the next goes in slot history_written % history_capacity
+SemaphoreHandle_t history_lock; // Guards slots being written and read (and history_file)
+
+/* Commands. Besides subscribing, a client controls the board with binary
+messages on the same WebSocket: a CommandHeader, then the opcode's payload
+(little-endian, like packets). The sequence number is the client's own, and
+comes back in a CommandAck (a binary message whose first byte, ack_kind,
+can't be taken for a packet's version), sent once the command has been
+applied. Payloads:
+- CMD_LOCK: uint8 lock (0 slow, 1 fast), uint8 on (0 or 1)
+- CMD_RELOCK: uint8 on
+- CMD_PZT: uint8 offset (as written to PZT_DAC_PIN)
+- CMD_SETTINGS: a SettingsCommand
+- CMD_STATE: none; the state (below) is sent to this client straight away
+Whatever changes the state, whether a command, an HTTP request or the board
+itself (relocking, rate control), has it pushed to every client, at most
+every state_push_interval, as {"state": {"status": ..., "settings": ...}} (as
+/state), so clients don't poll. A single byte is still taken as a PZT offset,
+as from earlier pages. */
+enum CommandOpcode : uint8_t { CMD_LOCK = 1, CMD_RELOCK = 2, CMD_PZT = 3, CMD_SETTINGS = 4, CMD_STATE = 5 };
+struct __attribute__((packed)) CommandHeader {
+  uint8_t opcode;
+  uint8_t reserved;
+  uint16_t sequence;
+};
+const unsigned int command_pins = 4; // (Whatever max_channels is, so the format doesn't change)
+struct __attribute__((packed)) SettingsCommand { // (Cf. /set_sample_settings)
+  uint32_t resolution;   // Microseconds
+  uint32_t duration;     // Microseconds
+  uint16_t points;       // Display points, for decimation
+  uint16_t pretrigger;   // Fraction (/65535)
+  uint8_t mode;          // SampleMode
+  uint8_t bits;          // 8 or 12
+  uint8_t decimation;    // Decimation
+  uint8_t capture;       // CaptureMode
+  uint8_t channel_count; // Pins given (0 to keep the channels)
+  uint8_t pins[command_pins];
+};
+const uint8_t ack_kind = 0xA0;
+enum CommandResult : uint8_t { CMD_OK = 0, CMD_UNKNOWN = 1, CMD_INVALID = 2 };
+struct __attribute__((packed)) CommandAck {
+  uint8_t kind;          // ack_kind
+  uint8_t opcode;
+  uint16_t sequence;     // As in the command
+  uint8_t result;        // CommandResult
+  uint8_t reserved;
+};
+const unsigned int state_push_interval = 100; // Milliseconds
+std::atomic<bool> state_changed(true); // State not yet pushed
+
+void setSubscription(AsyncWebSocketClient *client, unsigned int decimate, float max_rate, int bits, bool stats) {
+  // Add or replace a client's subscription, and tell it the result.
+  Subscription sub = {client->id(),
+    min(max(decimate, 1u), max_subscription_decimate),
+    max(max_rate, 0.0f),
+    (uint8_t)((bits == 8) ? 8 : 12),
+    0,
+    stats};
+  bool stored = false;
+  portENTER_CRITICAL(&subscriptions_lock);
+  for (int i = 0; i < max_subscriptions && !stored; i++) {
+    if (subscriptions[i].client_id == sub.client_id) {
+      subscriptions[i] = sub;
+      stored = true;
+    }
+  }
+  for (int i = 0; i < max_subscriptions && !stored; i++) {
+    if (subscriptions[i].client_id == 0) {
+      subscriptions[i] = sub;
+      stored = true;
+    }
+  }
+  portEXIT_CRITICAL(&subscriptions_lock);
+  if (!stored) {
+    Serial.printf("No room to subscribe WebSocket client #%u.\n", sub.client_id);
+    return;
+  }
+  char reply[112];
+  snprintf(reply, sizeof(reply),
+    "{\"subscribed\":{\"decimate\":%u,\"max_rate\":%g,\"bits\":%u,\"stats\":%s}}",
+    sub.decimate, sub.max_rate, sub.bits, sub.stats ? "true" : "false");
+  client->text(reply);
+}
+
+void removeSubscription(uint32_t client_id) {
+  portENTER_CRITICAL(&subscriptions_lock);
+  for (int i = 0; i < max_subscriptions; i++) {
+    if (subscriptions[i].client_id == client_id) { subscriptions[i].client_id = 0; }
+  }
+  portEXIT_CRITICAL(&subscriptions_lock);
+}
+
+void wakeAcquisition() {
+  // End low-power idle (see above), if acquisition is waiting there.
+  if (acquisition_task) { xTaskNotifyGive(acquisition_task); }
+}
+
+
+const char *modeName(SampleMode mode) {
+  return (mode == DMA) ? "dma" : "polled";
+}
+
+const char *decimationName(Decimation d) {
+  return (d == DECIMATE_AVERAGE) ? "average" :
+    (d == DECIMATE_ENVELOPE) ? "envelope" : "none";
+}
+
+const char *captureName(CaptureMode c) {
+  return (c == CAPTURE_TRIGGERED) ? "triggered" : "continuous";
+}
+
+CaptureMode parseCapture(const char *c, CaptureMode fallback) {
+  if (!c) { return fallback; }
+  if (strcmp(c, "continuous") == 0) { return CAPTURE_CONTINUOUS; }
+  if (strcmp(c, "triggered") == 0) { return CAPTURE_TRIGGERED; }
+  return fallback;
+}
+
+Decimation parseDecimation(const char *d, Decimation fallback) {
+  if (!d) { return fallback; }
+  if (strcmp(d, "none") == 0) { return DECIMATE_NONE; }
+  if (strcmp(d, "average") == 0) { return DECIMATE_AVERAGE; }
+  if (strcmp(d, "envelope") == 0) { return DECIMATE_ENVELOPE; }
+  return fallback;
+}
+
+void setSampleSettings(SampleSettings next, double resolution, double duration, SampleMode mode, int bits,
+    Decimation d, unsigned int points, CaptureMode capture, double pre) {
+  /* Publish next (the pending settings, with any channel changes), with
+  these settings, as limited. Note arguments are in milliseconds but the
+  resolution and duration are kept in microseconds.*/
+  next.mode = mode;
+  next.bits = fixed_sample_bits ? fixed_sample_bits : ((bits == 12) ? 12 : 8);
+  next.decimation = d;
+  next.points = min(max(points, 16u), packet_capacity);
+  next.capture = pretrigger_buffer ? capture : CAPTURE_CONTINUOUS; // (See setupArena.)
+  next.pretrigger = min(max(pre, 0.0), 1.0);
+  const int min_resolution = next.channel_count *
+    ((mode == DMA) ? dma_min_resolution : polled_min_resolution);
+  next.resolution = max((int)(resolution * 1000 + 0.5), min_resolution); // Hard limit on res.
+  if (mode == POLLED) { next.resolution -= next.resolution % next.channel_count; } // Whole timer ticks
+  next.duration = (int) min(max(
+    max(duration * 1000, 2.0 * next.resolution), PROFILE_MIN_DURATION * 1000.0),
+    PROFILE_MAX_DURATION * 1000.0); // Hard limits (see profile.h), else ESP can become unresponsive
+  /*Also enforce duration > 2*resolution (to ensure >1 sample)*/
+  portENTER_CRITICAL(&settings_lock);
+  pending_settings = next;
+  portEXIT_CRITICAL(&settings_lock);
+  Serial.println(" Sampling settings set to:");
+  Serial.printf("  Mode: %s\n", modeName(next.mode));
+  Serial.printf("  Bits: %u\n", next.bits);
+  Serial.print("  Channels:");
+  for (unsigned int c = 0; c < next.channel_count; c++) { Serial.printf(" %d", next.channel_pins[c]); }
+  Serial.println();
+  Serial.printf("  Decimation: %s (%u points)\n", decimationName(next.decimation), next.points);
+  Serial.printf("  Capture: %s (%.0f%% pre-trigger)\n", captureName(next.capture), next.pretrigger * 100);
+  Serial.printf("  Resolution: %.3f ms\n", next.resolution / 1000.0);
+  Serial.printf("  Duration: %.1f ms\n", next.duration / 1000.0);
+  Serial.println();
+  state_changed = true;
+}
+
+SampleMode parseMode(const char *mode, SampleMode fallback) {
+  // Unrecognised or missing modes leave the mode unchanged.
+  if (!mode) { return fallback; }
+  if (strcmp(mode, "dma") == 0) { return DMA; }
+  if (strcmp(mode, "polled") == 0) { return POLLED; }
+  return fallback;
+}
+
+void setChannelPins(SampleSettings &next, const int *pins, unsigned int n) {
+  /* Set next's channel list from n pin numbers. Pins without an ADC1 channel
+  (or repeats) are skipped; if none are left, the list is unchanged. Call
+  before setSampleSettings(), whose limits depend on it. */
+  int chosen[max_channels];
+  unsigned int count = 0;
+  for (unsigned int i = 0; i < n; i++) {
+    const int pin = pins[i];
+    bool repeated = false;
+    for (unsigned int c = 0; c < count; c++) { repeated |= (chosen[c] == pin); }
+    if (adc1Channel(pin) < 0 || repeated) {
+      Serial.printf("Ignoring channel pin %d (not a new ADC1 pin).\n", pin);
+    } else if (count < max_channels) {
+      chosen[count++] = pin;
+    }
+  }
+  if (count == 0) { return; }
+  memcpy(next.channel_pins, chosen, sizeof(chosen));
+  next.channel_count = count;
+}
+
+void setChannels(SampleSettings &next, JsonArray pins) {
+  // As setChannelPins(), from a JSON array (if given).
+  if (pins.isNull()) { return; }
+  int given[16];
+  unsigned int n = 0;
+  for (JsonVariant pinDoc : pins) {
+    if (n < 16) { given[n++] = pinDoc | -1; }
+  }
+  setChannelPins(next, given, n);
+}
+
+/* DMA sampling. The I2S peripheral has a 'built-in ADC' mode, where it drives
+ADC1 at the I2S sample rate and streams the results into a queue of DMA
+buffers. Each 16-bit word holds the channel number in its top 4 bits and the
+12-bit reading in the rest. */
+void startDMA(unsigned int resolution) {
+  i2s_config_t i2s_config = {}; // Zero-initialise unused fields
+  i2s_config.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN);
+  i2s_config.sample_rate = channel_count * 1000000 / resolution; // Conversions/s
+  i2s_config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+  i2s_config.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT;
+  i2s_config.communication_format = I2S_COMM_FORMAT_STAND_I2S;
+  i2s_config.intr_alloc_flags = 0;
+  i2s_config.dma_buf_count = dma_buf_count;
+  i2s_config.dma_buf_len = dma_buf_len;
+  i2s_config.use_apll = false;
+
+  if (i2s_driver_install(ADC_I2S_PORT, &i2s_config, 0, NULL) != ESP_OK) {
+    Serial.println("Failed to install I2S driver for DMA sampling.");
+    return;
+  }
+  // Same attenuation as analogRead() (full 0-3.3V range)
+  adc1_config_width(ADC_WIDTH_BIT_12);
+  for (unsigned int c = 0; c < channel_count; c++) {
+    adc1_config_channel_atten(channel_adc[c], ADC_ATTEN_DB_11);
+  }
+  i2s_set_adc_mode(ADC_UNIT_1, channel_adc[0]);
+  /* The driver only sets up one channel. For more, fill in the ADC's
+  'pattern table', whose entries it converts in turn. Each entry is a byte:
+  channel (4 bits), width (2 bits, 3 = 12-bit) and attenuation (2 bits,
+  3 = 11dB); the first entry is the most significant byte. */
+  uint32_t pattern = 0;
+  for (unsigned int c = 0; c < channel_count; c++) {
+    pattern |= (uint32_t)((channel_adc[c] << 4) | (3 << 2) | 3) << (24 - 8 * c);
+  }
+  SYSCON.saradc_ctrl.sar1_patt_len = channel_count - 1;
+  SYSCON.saradc_sar1_patt_tab[0] = pattern;
+  i2s_adc_enable(ADC_I2S_PORT);
+  dma_frame_mask = 0;
+  dma_running = true;
+}
+
+void stopDMA() {
+  if (dma_running) {
+    i2s_adc_disable(ADC_I2S_PORT);
+    i2s_driver_uninstall(ADC_I2S_PORT); // Polling works again after this.
+    dma_running = false;
+  }
+}
+
+static inline void IRAM_ATTR startConversion(adc1_channel_t channel) {
+  SENS.sar_meas_start1.sar1_en_pad = 1 << channel;
+  SENS.sar_meas_start1.meas1_start_sar = 0; // (Starts on the rising edge)
+  SENS.sar_meas_start1.meas1_start_sar = 1;
+}
+
+void IRAM_ATTR onSampleTimer() {
+  // Collect the conversion started last tick (see above)...
+  timer_frame.raw[timer_channel] = SENS.sar_meas_start1.meas1_data_sar;
+  timer_deadline += timer_tick;
+  if (++timer_channel == channel_count) {
+    timer_channel = 0;
+    const unsigned int head = timer_head.load(std::memory_order_relaxed);
+    if (head - timer_tail.load(std::memory_order_acquire) < timer_queue_size) {
+      timer_frames[head % timer_queue_size] = timer_frame;
+      timer_head.store(head + 1, std::memory_order_release);
+      if (++timer_batched == timer_batch && acquisition_task) {
+        timer_batched = 0;
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(acquisition_task, &woken);
+        portYIELD_FROM_ISR(woken);
+      }
+    } else {
+      timer_overrun = true;
+    }
+  }
+  // ...and start the next.
+  startConversion(channel_adc[timer_channel]);
+  if (timer_channel == 0) {
+    const int64_t late = esp_timer_get_time() - (int64_t)timer_deadline; // (esp_timer_get_time is in IRAM.)
+    timer_frame.lateness = (late < 0) ? 0 : (late > UINT16_MAX) ? UINT16_MAX : (uint16_t)late;
+  }
+}
+
+void startTimer(unsigned int resolution) {
+  /* Start polled sampling at the given resolution (microseconds per frame,
+  a multiple of channel_count). Must run on the acquisition core, as the
+  interrupt is allocated on the core that attaches it. */
+  adc_power_acquire(); // Keep the ADC powered between conversions.
+  for (unsigned int c = 0; c < channel_count; c++) {
+    adc1_get_raw(channel_adc[c]); // Hands the ADC to the SAR controller, set up for each channel.
+  }
+  timer_tick = resolution / channel_count;
+  timer_batch = min(max(1000 / resolution, 1u), timer_queue_size / 4);
+  timer_channel = 0;
+  timer_batched = 0;
+  timer_head = 0;
+  timer_tail = 0;
+  timer_overrun = false;
+  ulTaskNotifyTake(pdTRUE, 0); // (Any wake-up left from before)
+  if (!sample_timer) {
+    sample_timer = timerBegin(sample_timer_number, 80, true); // 1us ticks, from the 80MHz APB clock
+    timerAttachInterrupt(sample_timer, onSampleTimer, true);
+  }
+  timerAlarmWrite(sample_timer, timer_tick, true);
+  timerWrite(sample_timer, 0);
+  timer_start = timer_deadline = esp_timer_get_time();
+  startConversion(channel_adc[0]);
+  timerAlarmEnable(sample_timer);
+  timer_running = true;
+}
+
+void stopTimer() {
+  if (timer_running) {
+    timerAlarmDisable(sample_timer);
+    adc_power_release();
+    timer_running = false;
+  }
+}
+
+const char *calibrationName(esp_adc_cal_value_t source) {
+  switch (source) {
+  case ESP_ADC_CAL_VAL_EFUSE_VREF: return "efuse_vref";
+  case ESP_ADC_CAL_VAL_EFUSE_TP: return "efuse_two_point";
+  default: return "default_vref";
+  }
+}
+
+void calibrationHandler(AsyncWebServerRequest *request) {
+  /* GET /calibration: volts (mV) of every calibration_step-th ADC code, from
+  code 0 to 4095, for clients to interpolate. Codes are on the 12-bit scale,
+  so 8-bit samples are multiplied by 16 first. */
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->printf("{\"source\":\"%s\",\"step\":%u,\"millivolts\":[",
+    calibrationName(adc_calibration_source), calibration_step);
+  for (unsigned int code = 0; code <= 4095; code += calibration_step) {
+    response->printf(code ? ",%u" : "%u", adc_millivolts[code]);
+  }
+  response->print("]}");
+  request->send(response);
+}
+
+const char *relockName(RelockState state) {
+  switch (state) {
+  case RELOCK_IDLE: return "idle";
+  case RELOCK_MONITOR: return "monitoring";
+  case RELOCK_SEARCH: return "searching";
+  case RELOCK_ENGAGE_SLOW:
+  case RELOCK_ENGAGE_FAST: return "engaging";
+  case RELOCK_FAILED: return "failed";
+  default: return "off";
+  }
+}
+
+void setLock(int pin, std::atomic<bool> &lock, bool on) {
+  digitalWrite(pin, on ? HIGH : LOW);
+  lock = on;
+  state_changed = true;
+}
+
+void manualLock(int pin, std::atomic<bool> &lock, bool on) {
+  // A lock switched by a person, who takes over from relocking.
+  setLock(pin, lock, on);
+  relock_cancel = true;
+}
+
+void setRelock(bool on) {
+  relock_enabled = on;
+  state_changed = true;
+  if (on) { wakeAcquisition(); }
+}
+
+void stepPzt(void *arg) {
+  // Slew timer callback: move the output a step towards the target (see above).
+  static uint64_t last_step = 0;
+  const uint64_t now = esp_timer_get_time();
+  const int target = pzt_target;
+  const float max_step = (pzt_slew_rate > 0) ?
+    pzt_slew_rate * min(now - last_step, 2 * pzt_step_interval) / 1e6f : 256; // (Limited after a pause)
+  last_step = now;
+  if (fabsf(target - pzt_position) <= max_step) {
+    pzt_position = target;
+  } else {
+    pzt_position += (target > pzt_position) ? max_step : -max_step;
+  }
+  const uint8_t offset = (uint8_t)lroundf(pzt_position);
+  if (offset != pzt_offset) {
+    pzt_offset = offset;
+    dacWrite(PZT_DAC_PIN, offset);
+  }
+  if (pzt_position == target) {
+    esp_timer_stop(pzt_timer);
+    state_changed = true; // (For the output, in /status)
+    // A target set just now would have found the timer still running.
+    if (pzt_target != target) { esp_timer_start_periodic(pzt_timer, pzt_step_interval); }
+  }
+}
+
+void setPztTarget(int offset) {
+  // Slew the output to offset (0-255).
+  pzt_target = max(min(offset, 255), 0);
+  state_changed = true;
+  if (pzt_timer) {
+    esp_timer_start_periodic(pzt_timer, pzt_step_interval); // (Fails harmlessly if running)
+  } else { // No slewing
+    pzt_offset = pzt_target;
+    dacWrite(PZT_DAC_PIN, pzt_offset);
+  }
+}
+
+void manualPzt(uint8_t offset) {
+  setPztTarget(offset);
+  if (relock_state != RELOCK_MONITOR) { relock_cancel = true; } // Person takes over.
+}
+
+void updateRelock(const PacketHeader &header, uint16_t range) {
+  // Advance the auto-relock controller (see above) by one packet.
+  static unsigned int count = 0; // Packets counted towards the current step
+  static unsigned int locked_count = 0; // Packets locked since engaging
+  RelockState state = relock_state;
+  if (!relock_enabled) {
+    if (relock_state != RELOCK_OFF) { state_changed = true; }
+    relock_state = RELOCK_OFF;
+    return;
+  }
+  if (relock_cancel.exchange(false) || state == RELOCK_OFF) {
+    state = RELOCK_IDLE;
+  }
+  const bool locked = slow_lock && fast_lock;
+  switch (state) {
+  case RELOCK_IDLE:
+  case RELOCK_FAILED:
+    if (locked) { // Locks were switched on.
+      state = RELOCK_MONITOR;
+      count = 0;
+      locked_count = 0;
+      relock_attempts = 0;
+    }
+    break;
+  case RELOCK_MONITOR:
+    if (!locked) { // Switched off by hand
+      state = RELOCK_IDLE;
+      break;
+    }
+    if (range > relock_range || header.clipped > relock_clip) {
+      count++;
+    } else {
+      count = 0;
+      if (++locked_count >= relock_hold_packets) { relock_attempts = 0; }
+    }
+    if (count >= relock_unlock_packets) {
+      if (relock_attempts >= relock_max_attempts) {
+        Serial.println("Lock lost again; giving up auto-relock.");
+        state = RELOCK_FAILED;
+        break;
+      }
+      Serial.println("Lock lost; relocking.");
+      setLock(FAST_LOCK_PIN, fast_lock, false);
+      setLock(SLOW_LOCK_PIN, slow_lock, false);
+      relock_attempts++;
+      state = RELOCK_SEARCH;
+      count = 0;
+      locked_count = 0;
+    }
+    break;
+  case RELOCK_SEARCH: {
+    if (++count > relock_max_search) {
+      Serial.println("Relock search failed.");
+      state = RELOCK_FAILED;
+      break;
+    }
+    static unsigned int centred = 0; // Centred sweeps in a row
+    if (count == 1) { centred = 0; }
+    if (!(header.flags & PACKET_FLAG_TRIGGERED) || header.peak_count == 0) { break; }
+    int deepest = 0;
+    for (int i = 1; i < header.peak_count; i++) {
+      if (header.peaks[i].depth > header.peaks[deepest].depth) { deepest = i; }
+    }
+    const float error = ((int64_t)header.peaks[deepest].offset - header.trig_offset) / 1000.0; // ms
+    if (fabsf(error) <= relock_tolerance) {
+      if (++centred >= relock_centred_packets) {
+        setLock(SLOW_LOCK_PIN, slow_lock, true);
+        state = RELOCK_ENGAGE_SLOW;
+        count = 0;
+      }
+    } else {
+      centred = 0;
+      const int step = max(min((int)lroundf(relock_gain * error), relock_max_step), -relock_max_step);
+      setPztTarget(pzt_target - step);
+    }
+    break;
+  }
+  case RELOCK_ENGAGE_SLOW:
+    if (++count >= relock_settle_packets) {
+      setLock(FAST_LOCK_PIN, fast_lock, true);
+      state = RELOCK_ENGAGE_FAST;
+      count = 0;
+    }
+    break;
+  case RELOCK_ENGAGE_FAST:
+    if (++count >= relock_settle_packets) {
+      Serial.println("Relocked.");
+      state = RELOCK_MONITOR;
+      count = 0;
+    }
+    break;
+  default:
+    break;
+  }
+  if (state != relock_state) { state_changed = true; }
+  relock_state = state;
+}
+
+void finishPacket() {
+  finished_packets++;
+  flushBin();
+  // Header goes in front of the samples, in the same buffer.
+  PacketHeader header = packetHeader(elapsed);
+  if (sample_mode == DMA) { header.flags |= PACKET_FLAG_DMA; }
+  // Every packet is analysed, even if not sent, so relocking sees them all.
+  updateRelock(header, analyseSweep(header, input_buffer));
+
+  /* Pass the finished packet to the streaming task and move on to a free
+  slot. If there is none, this packet is dropped and its slot refilled. This
+  also bounds the number of messages queued per client, so the WebSocket
+  queue never overflows. Packets skipped by rate control are simply refilled,
+  and are not counted in the sequence (unlike drops). */
+  if (++rate_count < rate_divider) { return; }
+  rate_count = 0;
+  if (packet_fallback) { // Nothing to send it from (see fallback_packet)
+    packet_sequence++;
+    return;
+  }
+  int next_slot;
+  if (!free_queue.pop(next_slot)) {
+    packet_sequence++; // Leave a gap, marking the drop.
+    dropped_packets++;
+    return;
+  }
+  header.sequence = packet_sequence++;
+  memcpy(ring[fill_slot]->get(), &header, sizeof(header));
+  portENTER_CRITICAL(&latest_header_lock);
+  latest_header = header;
+  portEXIT_CRITICAL(&latest_header_lock);
+
+  const PacketDescriptor packet = {fill_slot, elapsed};
+  packet_queue.push(packet); // Can't be full, as it holds fewer than ring_size slots.
+  xTaskNotifyGive(streaming_task);
+  fill_slot = next_slot;
+}
+
+size_t historyRecordBytes(const uint8_t *record) {
+  // Length of a stored record (a reduced packet), from its header.
+  const PacketHeader *header = (const PacketHeader*)record;
+  return header->header_size + packedBytes(header->samples,
+    (header->flags & PACKET_FLAG_12BIT) ? 12 : 8);
+}
+
+void recordHistory(const uint8_t *packet) {
+  /* Called by the streaming task with each finished packet, keeping one every
+  history_interval. The copy is reduced outside the lock, so readers are only
+  held up for the store itself. */
+  static uint64_t last_time = 0;
+  static uint8_t record[history_stride];
+  const PacketHeader *header = (const PacketHeader*)packet;
+  if (history_capacity == 0) { return; }
+  if (history_written > 0 && header->start - last_time < (uint64_t)history_interval * 1000) { return; }
+  last_time = header->start;
+  const unsigned int width = ((header->flags & PACKET_FLAG_ENVELOPE) ? 2 : 1) *
+    max(header->channels, (uint8_t)1);
+  const unsigned int points = header->samples / width;
+  const unsigned int max_points = history_samples / width;
+  encodeReduced(packet, max((points + max_points - 1) / max_points, 1u), 8, record);
+
+  const uint32_t index = history_written;
+  const unsigned int slot = index % history_capacity;
+  xSemaphoreTake(history_lock, portMAX_DELAY);
+  if (history_file) {
+    history_file.seek(slot * history_stride);
+    history_file.write(record, history_stride);
+    history_file.flush();
+  } else {
+    memcpy(history_buffer + slot * history_stride, record, history_stride);
+  }
+  history_written = index + 1;
+  xSemaphoreGive(history_lock);
+}
+
+bool readHistory(uint32_t index, uint8_t *record) {
+  // Copy out record number index, if it's still held.
+  bool found = false;
+  xSemaphoreTake(history_lock, portMAX_DELAY);
+  const uint32_t written = history_written;
+  if (index < written && written - index <= history_capacity) {
+    const unsigned int slot = index % history_capacity;
+    if (history_file) {
+      history_file.seek(slot * history_stride);
+      found = history_file.read(record, history_stride) == history_stride;
+    } else {
+      memcpy(record, history_buffer + slot * history_stride, history_stride);
+      found = true;
+    }
+  }
+  xSemaphoreGive(history_lock);
+  return found;
+}
+
+uint32_t oldestHistory() {
+  // Index of the oldest record still held
+  const uint32_t written = history_written;
+  return (written > history_capacity) ? written - history_capacity : 0;
+}
+
+/* State of a /history response, kept between calls of its filler. Records
+are read one at a time, and may be split between chunks. */
+struct HistoryCursor {
+  uint32_t index;         // Next record to read
+  uint64_t from, to;      // Time range (microseconds since boot)
+  unsigned int decimate;  // Further reduction asked for
+  bool done = false;      // Passed the end of the range
+  uint8_t record[history_stride];
+  uint8_t reduced[history_stride];
+  size_t length = 0;      // Bytes of reduced left to send, from offset
+  size_t offset = 0;
+};
+
+void setHistoryRange(AsyncWebServerRequest *request, HistoryCursor &cursor) {
+  /* Range from the query: records with any part in [from, to] (ms since boot;
+  negative values count back from now, and both default to everything held),
+  each reduced by decimate (default 1, no reduction). */
+  const double now = esp_timer_get_time() / 1000.0;
+  double from = 0;
+  double to = now;
+  unsigned int decimate = 1;
+  if (request->hasParam("from")) { from = request->getParam("from")->value().toDouble(); }
+  if (request->hasParam("to")) { to = request->getParam("to")->value().toDouble(); }
+  if (request->hasParam("decimate")) { decimate = request->getParam("decimate")->value().toInt(); }
+  if (from < 0) { from = max(now + from, 0.0); }
+  if (to < 0) { to = max(now + to, 0.0); }
+  cursor.index = oldestHistory();
+  cursor.from = from * 1000;
+  cursor.to = to * 1000;
+  cursor.decimate = min(max(decimate, 1u), history_samples);
+}
+
+bool nextHistory(HistoryCursor &cursor) {
+  /* Load the next record in range into cursor.reduced (reduced as asked), or
+  return false at the end. Records overwritten since the response began are
+  skipped over. */
+  while (!cursor.done) {
+    cursor.index = max(cursor.index, oldestHistory());
+    if (cursor.index >= history_written || !readHistory(cursor.index, cursor.record)) { break; }
+    cursor.index++;
+    const PacketHeader *header = (const PacketHeader*)cursor.record;
+    if (header->start + header->elapsed < cursor.from) { continue; }
+    if (header->start > cursor.to) { break; } // (In time order)
+    if (cursor.decimate > 1) {
+      cursor.length = encodeReduced(cursor.record, cursor.decimate, 8, cursor.reduced);
+    } else {
+      cursor.length = historyRecordBytes(cursor.record);
+      memcpy(cursor.reduced, cursor.record, cursor.length);
+    }
+    cursor.offset = 0;
+    return true;
+  }
+  cursor.done = true;
+  return false;
+}
+
+size_t fillHistory(HistoryCursor &cursor, uint8_t *buffer, size_t max_len) {
+  // Write as much of the response as fits in buffer; returns 0 at the end.
+  size_t written = 0;
+  while (written < max_len) {
+    if (cursor.length == 0 && !nextHistory(cursor)) { break; }
+    const size_t n = min(cursor.length, max_len - written);
+    memcpy(buffer + written, cursor.reduced + cursor.offset, n);
+    written += n;
+    cursor.offset += n;
+    cursor.length -= n;
+  }
+  return written;
+}
+
+void historyHandler(AsyncWebServerRequest *request) {
+  // GET /history?from=&to=&decimate= (see setHistoryRange)
+  if (history_capacity == 0) {
+    request->send(503, "text/plain", "No history.");
+    return;
+  }
+  std::shared_ptr<HistoryCursor> cursor = std::make_shared<HistoryCursor>();
+  setHistoryRange(request, *cursor);
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/octet-stream",
+    [cursor](uint8_t *buffer, size_t max_len, size_t index) -> size_t {
+      return fillHistory(*cursor, buffer, max_len);
+    });
+  response->addHeader("Cache-Control", "no-store");
+  request->send(response);
+}
+
+/* Export, for offline analysis. /export streams either the history or the
+next few packets acquired ("live"), as CSV or in the binary packet format.
+It is written a chunk at a time as the connection takes it, straight from the
+history slots or the ring slot itself, so memory use doesn't depend on the
+length of the export. A live export holds ring slots (locked, like slots still
+being sent), which the streaming task offers it as each packet arrives. It
+holds at most two, so the next packet is ready as soon as one is written; only
+one live export can run at once. */
+std::atomic<bool> live_export_active(false); // A live export is running.
+const unsigned int live_export_depth = 2; // Slots it can hold: the one being written, and the next
+int live_export_slots[live_export_depth]; // Slots held, oldest first
+unsigned int live_export_held = 0;
+unsigned int live_export_wanted = 0; // Packets still to be offered
+portMUX_TYPE live_export_lock = portMUX_INITIALIZER_UNLOCKED;
+
+bool offerExport(int slot) {
+  // Called by the streaming task with each packet. Returns true if the export took the slot.
+  portENTER_CRITICAL(&live_export_lock);
+  const bool taken = live_export_wanted > 0 && live_export_held < live_export_depth;
+  if (taken) {
+    ring[slot]->lock(); // Not to be reused until unlocked
+    live_export_slots[live_export_held++] = slot;
+    live_export_wanted--;
+  }
+  portEXIT_CRITICAL(&live_export_lock);
+  return taken;
+}
+
+int heldExport() {
+  // Oldest slot the export holds, or -1 if it's waiting for one.
+  portENTER_CRITICAL(&live_export_lock);
+  const int slot = (live_export_held > 0) ? live_export_slots[0] : -1;
+  portEXIT_CRITICAL(&live_export_lock);
+  return slot;
+}
+
+void releaseExport(bool all) {
+  // Hand back the oldest slot held (or all of them, when the export ends).
+  portENTER_CRITICAL(&live_export_lock);
+  do {
+    if (live_export_held == 0) { break; }
+    ring[live_export_slots[0]]->unlock();
+    for (unsigned int i = 1; i < live_export_held; i++) { live_export_slots[i - 1] = live_export_slots[i]; }
+    live_export_held--;
+  } while (all);
+  if (all) { live_export_wanted = 0; }
+  portEXIT_CRITICAL(&live_export_lock);
+}
+
+struct ExportCursor {
+  bool csv;
+  bool live;
+  unsigned int packets_left = 0; // Live packets still to export
+  HistoryCursor history;
+  const uint8_t *packet = nullptr; // Packet being written
+  unsigned int point = 0;          // Next CSV row of it (or 1 once sent raw)
+  uint32_t layout = 0;             // Columns of the last CSV heading (0 before the first)
+  char line[160];                  // Formatted CSV row, or heading
+  const uint8_t *data = nullptr;   // Bytes to send next
+  size_t pending = 0;
+  ~ExportCursor() {
+    // (Also when the connection closes early)
+    if (live) {
+      releaseExport(true);
+      live_export_active = false;
+    }
+  }
+};
+
+bool nextExportPacket(ExportCursor &e) {
+  // The next packet to export, if one is ready.
+  if (!e.live) {
+    if (!nextHistory(e.history)) { return false; }
+    e.packet = e.history.reduced;
+    return true;
+  }
+  if (e.packets_left == 0) { return false; }
+  const int slot = heldExport();
+  if (slot < 0) { return false; } // Not arrived yet
+  e.packet = ring[slot]->get();
+  return true;
+}
+
+void doneExportPacket(ExportCursor &e) {
+  e.packet = nullptr;
+  e.point = 0;
+  if (e.live) {
+    e.packets_left--;
+    releaseExport(false);
+  }
+}
+
+size_t formatExportRow(ExportCursor &e, const PacketHeader &header, const uint8_t *samples) {
+  /* Format the next CSV line of e.packet into e.line: a heading whenever the
+  columns change (channels, or min/max pairs), otherwise a row of the time (µs
+  since boot) and each sample of the point, as stored (0-255 or 0-4095). */
+  const bool envelope = header.flags & PACKET_FLAG_ENVELOPE;
+  const unsigned int channels = max(header.channels, (uint8_t)1);
+  const unsigned int width = (envelope ? 2 : 1) * channels;
+  const uint32_t layout = (channels << 1) | (envelope ? 1 : 0);
+  size_t n = 0;
+  if (layout != e.layout) {
+    if (e.layout != 0) { e.line[n++] = '\n'; } // Blank line between tables
+    n += snprintf(e.line + n, sizeof(e.line) - n, "time_us");
+    for (unsigned int c = 0; c < channels; c++) {
+      n += snprintf(e.line + n, sizeof(e.line) - n, envelope ? ",ch%u_min,ch%u_max" : ",ch%u", c, c);
+    }
+    e.layout = layout;
+  } else {
+    const uint8_t bits = (header.flags & PACKET_FLAG_12BIT) ? 12 : 8;
+    n += snprintf(e.line, sizeof(e.line), "%llu",
+      (unsigned long long)(header.start + (uint64_t)e.point * header.resolution));
+    for (unsigned int k = 0; k < width; k++) {
+      n += snprintf(e.line + n, sizeof(e.line) - n, ",%u",
+        (unsigned int)unpackSample(samples, e.point * width + k, bits));
+    }
+    e.point++;
+  }
+  e.line[n++] = '\n';
+  return n;
+}
+
+size_t fillExport(ExportCursor &e, uint8_t *buffer, size_t max_len) {
+  /* Write as much of the export as fits in buffer. Returns 0 at the end, or
+  RESPONSE_TRY_AGAIN if a live export is waiting for its next packet. */
+  size_t written = 0;
+  while (written < max_len) {
+    if (e.pending == 0) {
+      if (!e.packet && !nextExportPacket(e)) {
+        if (written == 0 && e.live && e.packets_left > 0) { return RESPONSE_TRY_AGAIN; }
+        break;
+      }
+      PacketHeader header;
+      memcpy(&header, e.packet, sizeof(header));
+      const unsigned int width = ((header.flags & PACKET_FLAG_ENVELOPE) ? 2 : 1) *
+        max(header.channels, (uint8_t)1);
+      if (!e.csv && e.point == 0) { // The whole packet, as it is
+        e.data = e.packet;
+        e.pending = header.header_size +
+          packedBytes(header.samples, (header.flags & PACKET_FLAG_12BIT) ? 12 : 8);
+        e.point = 1;
+      } else if (e.csv && e.point < header.samples / width) {
+        e.pending = formatExportRow(e, header, e.packet + header.header_size);
+        e.data = (const uint8_t*)e.line;
+      } else {
+        doneExportPacket(e);
+        continue;
+      }
+    }
+    const size_t n = min(e.pending, max_len - written);
+    memcpy(buffer + written, e.data, n);
+    written += n;
+    e.data += n;
+    e.pending -= n;
+  }
+  return written;
+}
+
+void exportHandler(AsyncWebServerRequest *request) {
+  /* GET /export?source=&format=, where source is "history" (the default; with
+  the range of /history) or "live" (with packets=, the number of packets to
+  take, default 1), and format is "csv" (the default) or "raw" (packets in the
+  binary format, back to back). */
+  std::shared_ptr<ExportCursor> e = std::make_shared<ExportCursor>();
+  e->csv = !(request->hasParam("format") && request->getParam("format")->value() == "raw");
+  e->live = request->hasParam("source") && request->getParam("source")->value() == "live";
+  if (e->live) {
+    if (live_export_active.exchange(true)) {
+      e->live = false; // (Leave the running export alone.)
+      request->send(409, "text/plain", "A live export is already running.");
+      return;
+    }
+    wakeAcquisition();
+    e->packets_left = request->hasParam("packets") ?
+      max((int)request->getParam("packets")->value().toInt(), 1) : 1;
+    portENTER_CRITICAL(&live_export_lock);
+    live_export_wanted = e->packets_left; // The streaming task offers them from now on.
+    portEXIT_CRITICAL(&live_export_lock);
+  } else {
+    if (history_capacity == 0) {
+      request->send(503, "text/plain", "No history.");
+      return;
+    }
+    setHistoryRange(request, e->history);
+  }
+  AsyncWebServerResponse *response = request->beginChunkedResponse(
+    e->csv ? "text/csv" : "application/octet-stream",
+    [e](uint8_t *buffer, size_t max_len, size_t index) -> size_t {
+      return fillExport(*e, buffer, max_len);
+    });
+  response->addHeader("Content-Disposition", e->csv ?
+    "attachment; filename=\"export.csv\"" : "attachment; filename=\"export.bin\"");
+  response->addHeader("Cache-Control", "no-store");
+  request->send(response);
+}
+
+void writeHistogram(Print &out, const char *name, const char *help, Histogram &h, double scale) {
+  // One histogram in Prometheus text format, with values (and bounds) times scale.
+  uint32_t counts[histogram_buckets];
+  uint64_t sum;
+  h.read(counts, &sum);
+  out.printf("# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  uint32_t total = 0;
+  for (unsigned int k = 0; k < histogram_buckets; k++) {
+    total += counts[k];
+    if (k == histogram_buckets - 1) {
+      out.printf("%s_bucket{le=\"+Inf\"} %u\n", name, total);
+    } else {
+      out.printf("%s_bucket{le=\"%g\"} %u\n", name, (1u << k) * scale, total);
+    }
+  }
+  out.printf("%s_sum %g\n%s_count %u\n", name, sum * scale, name, total);
+}
+
+void writeMetric(Print &out, const char *name, const char *type, const char *help, double value) {
+  out.printf("# HELP %s %s\n# TYPE %s %s\n%s %g\n", name, help, name, type, name, value);
+}
+
+void metricsHandler(AsyncWebServerRequest *request) {
+  // GET /metrics: the instrumentation, for Prometheus to scrape.
+  AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+  writeHistogram(*response, "laser_sample_jitter_seconds",
+    "Time polled samples were taken after their deadline.", sample_jitter, 1e-6);
+  writeHistogram(*response, "laser_finish_seconds",
+    "Time to analyse a packet and hand it to the streaming task.", finish_time, 1e-6);
+  writeHistogram(*response, "laser_encode_seconds",
+    "Time to make each reduced encoding of a packet.", encode_time, 1e-6);
+  writeHistogram(*response, "laser_send_seconds",
+    "Time to queue a packet to every client due it.", send_time, 1e-6);
+  writeHistogram(*response, "laser_delivery_seconds",
+    "Time from queueing a packet until every client has sent it.", delivery_time, 1e-6);
+  writeHistogram(*response, "laser_packet_gap_seconds",
+    "Time between packets reaching the streaming task.", packet_gap, 1e-6);
+  writeHistogram(*response, "laser_queue_depth",
+    "Messages queued to clients as each packet arrives.", queue_depth, 1);
+  writeMetric(*response, "laser_packets_sent_total", "counter",
+    "Packets sent to at least one client.", (unsigned int)packets_sent);
+  writeMetric(*response, "laser_packets_dropped_total", "counter",
+    "Packets dropped for lack of a free ring slot.", (unsigned int)dropped_packets);
+  writeMetric(*response, "laser_client_skips_total", "counter",
+    "Packets a client missed because its queue was full.", (unsigned int)client_skips);
+  writeMetric(*response, "laser_encode_shortages_total", "counter",
+    "Packets a client missed for lack of a free encode buffer.", (unsigned int)encode_shortages);
+  writeMetric(*response, "laser_allocation_failures_total", "counter",
+    "Packet slots or encode buffers that could not be allocated, so were not sent.", (unsigned int)allocation_failures);
+  writeMetric(*response, "laser_congestion_level", "gauge",
+    "Rate control level (0 when keeping up).", (unsigned int)congestion_level);
+  writeMetric(*response, "laser_packet_rate", "gauge", "Packets sent per second.", packet_rate);
+  writeMetric(*response, "laser_queued_messages", "gauge",
+    "Messages queued to clients.", queued_messages);
+  writeMetric(*response, "laser_clients", "gauge", "WebSocket clients connected.", ws.count());
+  writeMetric(*response, "laser_free_heap_bytes", "gauge", "Free internal RAM.",
+    heap_caps_get_free_size(MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL));
+  writeMetric(*response, "laser_min_free_heap_bytes", "gauge", "Least free internal RAM since boot.",
+    heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL));
+  writeMetric(*response, "laser_largest_free_block_bytes", "gauge", "Largest free block of internal RAM.",
+    heap_caps_get_largest_free_block(MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL));
+  response->addHeader("Cache-Control", "no-store");
+  request->send(response);
+}
+
+/* JSON control plane. The web server runs every handler in the async TCP
+task, one at a time, so they share one document (cleared for each use) and
+write replies straight into an AsyncResponseStream, rather than building a
+String and copying it. /set_sample_settings bodies are collected in the fixed
+settings_body, and the request is answered with the settings as applied.
+/state combines /status and /get_sample_settings, for polling. */
+StaticJsonDocument<2048> json_doc;
+char settings_body[512];
+size_t settings_body_length = 0;
+AsyncWebServerRequest *settings_body_owner = nullptr; // Request whose body is in settings_body
+
+void writeStatus(JsonObject statusDoc) {
+  statusDoc["name"] = laser_name;
+  statusDoc["profile"] = PROFILE_NAME;
+  statusDoc["slow"] = (bool)slow_lock;
+  statusDoc["fast"] = (bool)fast_lock;
+  statusDoc["relock"] = relockName(relock_state);
+  // Memory, so long captures aren't cut short unexpectedly
+  JsonObject memoryDoc = statusDoc.createNestedObject("memory");
+  memoryDoc["packet_capacity"] = packet_capacity; // Samples
+  memoryDoc["pretrigger_capacity"] = pretrigger_capacity; // 0 if triggered capture is unavailable
+  memoryDoc["allocation_failures"] = (unsigned int)allocation_failures;
+  memoryDoc["psram"] = arena_psram;
+  memoryDoc["free_internal"] = heap_caps_get_free_size(MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL);
+  memoryDoc["free_psram"] = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+  statusDoc["pzt"] = (int)pzt_target;
+  statusDoc["pzt_output"] = pzt_offset; // (Behind pzt while slewing)
+  JsonObject historyDoc = statusDoc.createNestedObject("history");
+  historyDoc["records"] = min((uint32_t)history_written, (uint32_t)history_capacity);
+  historyDoc["capacity"] = history_capacity;
+  historyDoc["interval"] = history_interval; // ms
+  historyDoc["file"] = (bool)history_file;
+  // Analysis of the latest packet (times in ms from the packet start)
+  portENTER_CRITICAL(&latest_header_lock);
+  const PacketHeader header = latest_header;
+  portEXIT_CRITICAL(&latest_header_lock);
+  JsonObject sweepDoc = statusDoc.createNestedObject("sweep");
+  sweepDoc["sequence"] = header.sequence;
+  sweepDoc["clipped"] = header.clipped / 65535.0;
+  if (header.flags & PACKET_FLAG_ZERO_CROSSING) { // (Omitted if none)
+    sweepDoc["zero_crossing"] = header.zero_crossing / 1000.0;
+  }
+  JsonArray peaksDoc = sweepDoc.createNestedArray("peaks");
+  for (int i = 0; i < header.peak_count; i++) {
+    JsonObject peakDoc = peaksDoc.createNestedObject();
+    peakDoc["time"] = header.peaks[i].offset / 1000.0;
+    peakDoc["depth"] = header.peaks[i].depth;
+  }
+  /* Would be convenient to just read the state of the pins directly,
+  but this is unreliable as they are set to OUTPUT mode.*/
+}
+
+void writeSettings(JsonObject settingsDoc) {
+  /* What the current sampling settings are: the pending values, as these
+  are what the client asked for and apply from the next packet onwards. */
+  const SampleSettings next = pendingSettings();
+  settingsDoc["duration"] = (double)(next.duration / 1000.0);
+  settingsDoc["resolution"] = (double)(next.resolution / 1000.0);
+  settingsDoc["mode"] = modeName(next.mode);
+  settingsDoc["bits"] = next.bits;
+  JsonArray channelsDoc = settingsDoc.createNestedArray("channels");
+  for (unsigned int c = 0; c < next.channel_count; c++) { channelsDoc.add(next.channel_pins[c]); }
+  settingsDoc["decimation"] = decimationName(next.decimation);
+  settingsDoc["points"] = next.points;
+  settingsDoc["capture"] = captureName(next.capture);
+  settingsDoc["pretrigger"] = next.pretrigger;
+  // What rate control is actually delivering
+  JsonObject effectiveDoc = settingsDoc.createNestedObject("effective");
+  effectiveDoc["level"] = (unsigned int)congestion_level;
+  effectiveDoc["points"] = effective_points;
+  effectiveDoc["rate_divider"] = rate_divider;
+  effectiveDoc["packet_rate"] = packet_rate;
+  effectiveDoc["latency"] = send_latency / 1000.0; // ms
+  effectiveDoc["queued"] = queued_messages;
+  effectiveDoc["dropped"] = (unsigned int)dropped_packets;
+  effectiveDoc["truncated"] = packet_truncated; // Packets cut short by packet_capacity
+  // Bounds, so the client can adjust its slider ranges.
+  settingsDoc["min_resolution"] = (double)(next.channel_count *
+    ((next.mode == DMA) ? dma_min_resolution : polled_min_resolution) / 1000.0);
+}
+
+void sendJson(AsyncWebServerRequest *request) {
+  // Reply with json_doc.
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  serializeJson(json_doc, *response);
+  request->send(response);
+}
+
+template <void (*write)(JsonObject)>
+void jsonHandler(AsyncWebServerRequest *request) {
+  json_doc.clear();
+  write(json_doc.to<JsonObject>());
+  sendJson(request);
+}
+
+void stateHandler(AsyncWebServerRequest *request) {
+  // GET /state: {"status": (as /status), "settings": (as /get_sample_settings)}
+  json_doc.clear();
+  writeStatus(json_doc.createNestedObject("status"));
+  writeSettings(json_doc.createNestedObject("settings"));
+  sendJson(request);
+}
+
+void settingsBodyHandler(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+  // Collect a /set_sample_settings body, which may arrive in several chunks.
+  if (total > sizeof(settings_body)) { return; }
+  if (index == 0) { settings_body_owner = request; } // (Any other is abandoned.)
+  if (settings_body_owner != request) { return; }
+  memcpy(settings_body + index, data, len);
+  settings_body_length = index + len;
+}
+
+void settingsHandler(AsyncWebServerRequest *request) {
+  /* POST /set_sample_settings, once the body is in: apply the settings, and
+  reply with them as applied (which may differ from those asked for). */
+  if (settings_body_owner != request || settings_body_length != request->contentLength()) {
+    request->send(400, "text/plain", "Expected a JSON body of at most 512 bytes.");
+    return;
+  }
+  settings_body_owner = nullptr;
+  json_doc.clear();
+  if (deserializeJson(json_doc, settings_body, settings_body_length)) {
+    request->send(400, "text/plain", "Invalid JSON.");
+    return;
+  }
+  const JsonObject jsonObj = json_doc.as<JsonObject>();
+  SampleSettings next = pendingSettings();
+  setChannels(next, jsonObj["channels"]);
+  setSampleSettings(next, jsonObj["resolution"] | next.resolution / 1000.0,
+    jsonObj["duration"] | next.duration / 1000.0,
+    parseMode(jsonObj["mode"], next.mode), jsonObj["bits"] | next.bits,
+    parseDecimation(jsonObj["decimation"], next.decimation),
+    jsonObj["points"] | next.points,
+    parseCapture(jsonObj["capture"], next.capture),
+    jsonObj["pretrigger"] | next.pretrigger);
+  json_doc.clear();
+  writeSettings(json_doc.to<JsonObject>());
+  sendJson(request);
+}
+
+void writeState(JsonDocument &doc) {
+  // {"state": ...} (see Commands)
+  doc.clear();
+  JsonObject stateDoc = doc.createNestedObject("state");
+  writeStatus(stateDoc.createNestedObject("status"));
+  writeSettings(stateDoc.createNestedObject("settings"));
+}
+
+AsyncWebSocketMessageBuffer *jsonMessage(JsonDocument &doc) {
+  // doc as a WebSocket text message (nullptr if out of memory)
+  const size_t length = measureJson(doc);
+  AsyncWebSocketMessageBuffer *buffer = ws.makeBuffer(length); // (With room for a terminator)
+  if (buffer) { serializeJson(doc, (char*)buffer->get(), length + 1); }
+  return buffer;
+}
+
+CommandResult runCommand(AsyncWebSocketClient *client, uint8_t opcode, const uint8_t *payload, size_t len) {
+  // Apply a command (see Commands).
+  switch (opcode) {
+  case CMD_LOCK:
+    if (len < 2 || payload[0] > 1) { return CMD_INVALID; }
+    if (payload[0] == 0) {
+      manualLock(SLOW_LOCK_PIN, slow_lock, payload[1] != 0);
+    } else {
+      manualLock(FAST_LOCK_PIN, fast_lock, payload[1] != 0);
+    }
+    return CMD_OK;
+  case CMD_RELOCK:
+    if (len < 1) { return CMD_INVALID; }
+    setRelock(payload[0] != 0);
+    return CMD_OK;
+  case CMD_PZT:
+    if (len < 1) { return CMD_INVALID; }
+    manualPzt(payload[0]);
+    return CMD_OK;
+  case CMD_SETTINGS: {
+    SettingsCommand settings;
+    if (len < sizeof(settings)) { return CMD_INVALID; }
+    memcpy(&settings, payload, sizeof(settings));
+    if (settings.mode > DMA || settings.decimation > DECIMATE_ENVELOPE ||
+        settings.capture > CAPTURE_TRIGGERED || settings.channel_count > command_pins ||
+        (settings.capture == CAPTURE_TRIGGERED && !pretrigger_buffer)) {
+      return CMD_INVALID;
+    }
+    SampleSettings next = pendingSettings();
+    if (settings.channel_count > 0) {
+      int pins[command_pins];
+      for (unsigned int c = 0; c < settings.channel_count; c++) { pins[c] = settings.pins[c]; }
+      setChannelPins(next, pins, settings.channel_count);
+    }
+    setSampleSettings(next, settings.resolution / 1000.0, settings.duration / 1000.0,
+      (SampleMode)settings.mode, settings.bits, (Decimation)settings.decimation,
+      settings.points, (CaptureMode)settings.capture, settings.pretrigger / 65535.0);
+    return CMD_OK;
+  }
+  case CMD_STATE: {
+    writeState(json_doc);
+    AsyncWebSocketMessageBuffer *buffer = jsonMessage(json_doc);
+    if (buffer) { client->text(buffer); }
+    return CMD_OK;
+  }
+  default:
+    return CMD_UNKNOWN;
+  }
+}
+
+void handleCommand(AsyncWebSocketClient *client, const uint8_t *data, size_t len) {
+  // A binary message: a command, to be acknowledged, or a bare PZT offset.
+  if (len == 1) {
+    manualPzt(data[0]);
+    return;
+  }
+  CommandHeader command;
+  if (len < sizeof(command)) { return; }
+  memcpy(&command, data, sizeof(command));
+  const CommandResult result = runCommand(client, command.opcode, data + sizeof(command), len - sizeof(command));
+  const CommandAck ack = {ack_kind, command.opcode, command.sequence, result, 0};
+  client->binary((const uint8_t*)&ack, sizeof(ack));
+}
+
+/* Incoming WebSocket messages may come in several frames, and frames in
+several pieces, so they're gathered in message_buffer, one at a time. A
+message starting abandons any other still being gathered, and messages too
+long for it (no command or subscription is) are ignored. */
+uint8_t message_buffer[256];
+size_t message_length = 0;
+uint32_t message_owner = 0; // Client whose message is in message_buffer (0 if none)
+
 // Handle a WebSocket message
-void handleWebSocketMessage(void *arg, uint8_t *data, size_t len) {
+void handleWebSocketMessage(AsyncWebSocketClient *client, void *arg, uint8_t *data, size_t len) {
   AwsFrameInfo *info = (AwsFrameInfo*)arg;
-  if (info->final && info->index == 0 && info->len == len && info->opcode == WS_BINARY) {
-    /* Received a single binary packet. This is expected to contain a single
-    8-bit integer (we discard anything else)*/
-    dacWrite(PZT_DAC_PIN, data[0]);
+  if (info->num == 0 && info->index == 0) { // A new message
+    message_owner = client->id();
+    message_length = 0;
+  }
+  if (message_owner != client->id()) { return; }
+  if (message_length + len > sizeof(message_buffer)) {
+    message_owner = 0;
+    return;
+  }
+  memcpy(message_buffer + message_length, data, len);
+  message_length += len;
+  if (!(info->final && info->index + len == info->len)) { return; } // More to come
+  message_owner = 0;
+  if (info->message_opcode == WS_BINARY) {
+    handleCommand(client, message_buffer, message_length);
+  } else if (info->message_opcode == WS_TEXT) {
+    // A subscription (see above)
+    StaticJsonDocument<128> messageDoc;
+    if (deserializeJson(messageDoc, message_buffer, message_length)) { return; }
+    JsonObject subscribeDoc = messageDoc["subscribe"];
+    if (subscribeDoc.isNull()) { return; }
+    setSubscription(client, subscribeDoc["decimate"] | 1u,
+      subscribeDoc["max_rate"] | 0.0f, subscribeDoc["bits"] | 12, subscribeDoc["stats"] | false);
   }
 }
 
@@ -64,12 +1734,16 @@ void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventTyp
   switch (type) {
   case WS_EVT_CONNECT:
     Serial.printf("WebSocket client #%u connected from %s\n", client->id(), client->remoteIP().toString().c_str());
+    setSubscription(client, 1, 0, 12, false); // Full stream until it subscribes.
+    state_changed = true; // (So it gets the state.)
+    wakeAcquisition();
     break;
   case WS_EVT_DISCONNECT:
     Serial.printf("WebSocket client #%u disconnected\n", client->id());
+    removeSubscription(client->id());
     break;
   case WS_EVT_DATA:
-    handleWebSocketMessage(arg, data, len);
+    handleWebSocketMessage(client, arg, data, len);
     break;
   case WS_EVT_PONG:
   case WS_EVT_ERROR:
@@ -78,30 +1752,562 @@ void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventTyp
   }
 }
 
-void setSampleSettings(double resolution, double duration) {
-  /* Duration takes effect immediately but resolution waits until a
-  new packet. Note arguments are in milliseconds but next_resolution
-  and sample_duration are in microseconds.*/
-  next_resolution = max((int)(resolution * 1000), 100); //Hard limit 0.1ms res
-  sample_duration = (int) min(max(
-    max(duration * 1000, 2.0 * next_resolution), 30000.0),
-    20000000.0); // Hard min 30ms and max 20sec, else ESP can become unresponsive
-  /*Also enforce duration > 2*resolution (to ensure >1 sample)*/
-  Serial.println(" Sampling settings set to:");
-  Serial.printf("  Resolution: %.1f ms\n", next_resolution / 1000.0);
-  Serial.printf("  Duration: %.1f ms\n", sample_duration / 1000.0);
-  Serial.println();
+StaticJsonDocument<2048> push_doc; // The streaming task's (json_doc is the web server's)
+
+void pushState(uint64_t now) {
+  // Push the state to every client, if it has changed (see Commands).
+  static uint64_t last_push = 0;
+  if (!state_changed || now - last_push < state_push_interval * 1000ull) { return; }
+  state_changed = false; // (Before reading it, so later changes aren't missed.)
+  last_push = now;
+  if (ws.count() == 0) { return; }
+  writeState(push_doc);
+  AsyncWebSocketMessageBuffer *buffer = jsonMessage(push_doc);
+  if (buffer) { ws.textAll(buffer); }
 }
 
-void settingsHandler(AsyncWebServerRequest *request, JsonVariant &json) {
-  const JsonObject &jsonObj = json.as<JsonObject>();
-  setSampleSettings(jsonObj["resolution"], jsonObj["duration"]);
-  request->redirect("/get_sample_settings");
+AsyncWebSocketMessageBuffer *takeEncodeBuffer(bool *taken) {
+  // A pool buffer which is neither in flight nor already used for this packet.
+  for (int i = 0; i < encode_pool_size; i++) {
+    if (taken[i]) { continue; }
+    if (!encode_pool[i]) {
+      encode_pool[i] = new AsyncWebSocketMessageBuffer(sizeof(PacketHeader)); // Resized on use
+    } else if (!encode_pool[i]->canDelete()) {
+      continue;
+    }
+    taken[i] = true;
+    return encode_pool[i];
+  }
+  return nullptr;
+}
+
+unsigned int streamPacket(const PacketDescriptor &packet, bool &slot_held) {
+  /* Send a packet to each client due one, per its subscription. Returns the
+  number of clients sent to; slot_held says whether any were sent the ring slot
+  itself (by reference, so the slot must persist until they are done). */
+  Subscription subs[max_subscriptions];
+  portENTER_CRITICAL(&subscriptions_lock);
+  memcpy(subs, subscriptions, sizeof(subs));
+  portEXIT_CRITICAL(&subscriptions_lock);
+
+  AsyncWebSocketMessageBuffer *slot = ring[packet.slot];
+  const uint8_t slot_bits = (((const PacketHeader*)slot->get())->flags & PACKET_FLAG_12BIT) ? 12 : 8;
+  // Reduced encodings of this packet made so far, shared between clients.
+  AsyncWebSocketMessageBuffer *encoded[max_subscriptions];
+  unsigned int encoded_decimate[max_subscriptions];
+  uint8_t encoded_bits[max_subscriptions];
+  int encoded_count = 0;
+  bool taken[encode_pool_size] = {};
+
+  const uint64_t now = esp_timer_get_time();
+  unsigned int sent = 0;
+  slot_held = false;
+  for (int i = 0; i < max_subscriptions; i++) {
+    Subscription &sub = subs[i];
+    if (sub.client_id == 0) { continue; }
+    const uint64_t interval = (sub.max_rate > 0) ? 1e6 / sub.max_rate : 0;
+    if (now - sub.last_sent < interval) { continue; }
+    AsyncWebSocketClient *client = ws.client(sub.client_id);
+    if (!client) { continue; }
+    if (client->queueIsFull()) { // It misses this one.
+      client_skips++;
+      continue;
+    }
+
+    const uint8_t bits = min(sub.bits, slot_bits);
+    AsyncWebSocketMessageBuffer *buffer = nullptr;
+    if (sub.decimate == 1 && bits == slot_bits) {
+      buffer = slot;
+      slot_held = true;
+    } else {
+      for (int j = 0; j < encoded_count && !buffer; j++) {
+        if (encoded_decimate[j] == sub.decimate && encoded_bits[j] == bits) { buffer = encoded[j]; }
+      }
+      if (!buffer) {
+        buffer = takeEncodeBuffer(taken);
+        if (!buffer) { // Pool exhausted
+          encode_shortages++;
+          continue;
+        }
+        const uint32_t cycles = ESP.getCycleCount();
+        const size_t bytes = encodeReduced(slot->get(), sub.decimate, bits, nullptr);
+        if ((buffer->length() != bytes || !buffer->get()) && !buffer->reserve(bytes)) {
+          allocation_failures++; // It misses this one (see startPacket).
+          continue;
+        }
+        encodeReduced(slot->get(), sub.decimate, bits, buffer->get());
+        encode_time.record(microsSince(cycles));
+        encoded[encoded_count] = buffer;
+        encoded_decimate[encoded_count] = sub.decimate;
+        encoded_bits[encoded_count] = bits;
+        encoded_count++;
+      }
+    }
+    client->binary(buffer);
+    sent++;
+    // Keep to the average rate, unless this client has fallen well behind.
+    sub.last_sent = (now - sub.last_sent < 2 * interval) ? sub.last_sent + interval : now;
+  }
+
+  portENTER_CRITICAL(&subscriptions_lock);
+  for (int i = 0; i < max_subscriptions; i++) {
+    // (Unless the client resubscribed or left meanwhile)
+    if (subscriptions[i].client_id == subs[i].client_id) {
+      subscriptions[i].last_sent = subs[i].last_sent;
+    }
+  }
+  portEXIT_CRITICAL(&subscriptions_lock);
+  return sent;
+}
+
+void newStream(uint64_t start) {
+  /* Restart the sample clock (see Triggers in pipeline.h) at start, dropping
+  triggers placed on the old one. */
+  stream_start = start;
+  trigger_tail = trigger_head.load(std::memory_order_acquire);
+}
+
+bool startPacket(uint64_t start) {
+  /* Apply pending settings, restarting DMA or the timer if its clock needs to
+  change. Returns whether it restarted, on a fresh timebase. */
+  const SampleSettings next = pendingSettings();
+  const bool channels_changed = next.channel_count != channel_count ||
+    memcmp(next.channel_pins, channel_pins, channel_count * sizeof(int)) != 0;
+  if (dma_running && (next.mode != DMA || next.resolution != time_resolution || channels_changed)) {
+    stopDMA();
+  }
+  if (timer_running && (next.mode != POLLED || next.resolution != time_resolution || channels_changed)) {
+    stopTimer();
+  }
+  if (channels_changed) {
+    channel_count = next.channel_count;
+    memcpy(channel_pins, next.channel_pins, sizeof(channel_pins));
+  }
+  memset(dma_channel_index, 0xFF, sizeof(dma_channel_index));
+  for (unsigned int c = 0; c < channel_count; c++) {
+    channel_adc[c] = (adc1_channel_t)adc1Channel(channel_pins[c]);
+    dma_channel_index[channel_adc[c]] = c;
+  }
+  if (channels_changed || !polled_adc_ready) { // Full 0-3.3V range (as DMA sets too)
+    for (unsigned int c = 0; c < channel_count; c++) {
+      adc1_config_channel_atten(channel_adc[c], ADC_ATTEN_DB_11);
+    }
+    polled_adc_ready = true;
+  }
+  packet_settings = next;
+  time_resolution = next.resolution;
+  sample_mode = next.mode;
+  sample_bits = next.bits;
+  decimation = next.decimation;
+  capture_mode = next.capture;
+  pretrigger = next.pretrigger;
+  bool restarted = false;
+  if (sample_mode == DMA && !dma_running) {
+    startDMA(time_resolution);
+    restarted = true;
+    start = esp_timer_get_time(); // Fresh DMA timebase
+    newStream(start);
+    if (!dma_running) { // Fall back to polling
+      sample_mode = packet_settings.mode = POLLED;
+      time_resolution = max(time_resolution, polled_min_resolution * channel_count);
+      time_resolution -= time_resolution % channel_count; // (As setSampleSettings)
+      packet_settings.resolution = time_resolution;
+      portENTER_CRITICAL(&settings_lock);
+      if (pending_settings.mode == DMA) { // (Unless changed meanwhile)
+        pending_settings.mode = POLLED;
+        pending_settings.resolution = time_resolution;
+      }
+      portEXIT_CRITICAL(&settings_lock);
+      state_changed = true;
+    }
+  }
+  if (sample_mode == POLLED && !timer_running) {
+    startTimer(time_resolution);
+    restarted = true;
+    start = timer_start; // Fresh timer timebase
+    newStream(start);
+  }
+  /* The packet length is fixed when it starts, because the message buffer
+  must be exactly as long as the data sent. Reallocation only happens when
+  the settings change. */
+  // Rate control reduces points per packet first (if decimating), then packet rate.
+  const unsigned int level = congestion_level;
+  const unsigned int point_shift = (decimation != DECIMATE_NONE) ? min(level, max_point_shift) : 0;
+  rate_divider = 1 << min(level - point_shift, max_rate_shift);
+  effective_points = packet_settings.points >> point_shift;
+  planPacket(packet_settings.duration, effective_points, packet_capacity);
+  AsyncWebSocketMessageBuffer *buffer = ring[fill_slot];
+  const size_t packet_bytes = sizeof(PacketHeader) + sampleBytes(packet_samples);
+  // (A failed reserve() leaves the length set but no data, so check both.)
+  packet_fallback = false;
+  if ((buffer->length() != packet_bytes || !buffer->get()) && !buffer->reserve(packet_bytes)) {
+    allocation_failures++;
+    packet_fallback = true;
+    planPacket(packet_settings.duration, effective_points, min_packet_capacity); // (Fits fallback_packet)
+  }
+  input_buffer = (packet_fallback ? fallback_packet : buffer->get()) + sizeof(PacketHeader);
+  resetPacket(start);
+  return restarted;
 }
 
 void IRAM_ATTR onTrig() {
-  /* Interrupts need to be in IRAM, for fast access. */
-  trig_time = micros();
+  /* Record the trigger time; acquisition places it on the sample clock (see
+  pipeline.h). Interrupts need to be in IRAM, for fast access, so this does no
+  division or reading of shared 64-bit state. */
+  const unsigned int head = trigger_head.load(std::memory_order_relaxed);
+  trigger_ring[head % trigger_ring_size] = esp_timer_get_time();
+  trigger_head.store(head + 1, std::memory_order_release);
+}
+
+void loopTimer() {
+  /* Wait (up to 10ms, so idling and setting changes are still noticed) for
+  the timer interrupt to queue a batch of frames, and take them. As with DMA,
+  packet times are counted in frames from when the timer started, so packets
+  follow each other without gaps. */
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+  if (timer_overrun) { // Frames were lost, so restart on a fresh timebase.
+    stopTimer();
+    startPacket(esp_timer_get_time());
+    return;
+  }
+  unsigned int tail = timer_tail.load(std::memory_order_relaxed);
+  const unsigned int head = timer_head.load(std::memory_order_acquire);
+  while (tail != head) {
+    const TimerFrame &frame = timer_frames[tail % timer_queue_size];
+    sample_jitter.record(frame.lateness);
+    takeFrame(frame.raw);
+    timer_tail.store(++tail, std::memory_order_release); // (Done with the slot)
+    if (packetFull()) {
+      elapsed = (uint64_t)time_resolution * n_raw;
+      const uint32_t cycles = ESP.getCycleCount();
+      finishPacket();
+      finish_time.record(microsSince(cycles));
+      if (startPacket(packet_start + elapsed)) {
+        return; // Settings changed; the old queue was discarded.
+      }
+    }
+  }
+}
+
+void loopDMA() {
+  /* Wait (up to 10ms, so idling and setting changes are still noticed) for
+  the DMA to finish a block. Packet times are counted in samples from when DMA
+  started, since the I2S clock (not the acquisition task) sets when each
+  sample was taken. A packet boundary can fall part-way through a block; the
+  remainder begins the next packet, so there are no gaps between packets. */
+  size_t bytes_read = 0;
+  i2s_read(ADC_I2S_PORT, dma_buffer, sizeof(dma_buffer), &bytes_read, pdMS_TO_TICKS(10));
+  const unsigned int count = bytes_read / sizeof(uint16_t);
+  const unsigned int channels = frameChannels();
+  for (unsigned int i = 0; i < count; i++) {
+    /* The I2S peripheral stores each pair of 16-bit samples swapped, so read
+    them back in order with i^1 (count is always even). The top 4 bits hold
+    the channel number, which places the reading in the frame; a frame is
+    complete once its last channel arrives. */
+    const uint16_t word = dma_buffer[i ^ 1];
+    const uint8_t c = dma_channel_index[word >> 12];
+    if (c >= channels) { continue; } // (Not one of ours)
+    dma_frame[c] = word & 0x0FFF;
+    dma_frame_mask |= 1 << c;
+    if (c != channels - 1) { continue; }
+    if (dma_frame_mask != (1u << channels) - 1) { // Started mid-frame
+      dma_frame_mask = 0;
+      continue;
+    }
+    dma_frame_mask = 0;
+    takeFrame(dma_frame);
+    if (packetFull()) {
+      elapsed = (uint64_t)time_resolution * n_raw;
+      const uint32_t cycles = ESP.getCycleCount();
+      finishPacket();
+      finish_time.record(microsSince(cycles));
+      if (startPacket(packet_start + elapsed)) {
+        return; // Settings changed; discard the rest of the old DMA stream.
+      }
+    }
+  }
+}
+
+void setCpuClock(uint32_t mhz) {
+  setCpuFrequencyMhz(mhz);
+  cycles_per_us = mhz; // For the instrumentation
+}
+
+void idleAcquisition(TickType_t timeout) {
+  /* Stop sampling, and wait in low power (see above) until woken or until
+  timeout. Sampling restarts with a fresh timebase afterwards. */
+  if (!idling) {
+    stopDMA();
+    stopTimer();
+    packet_start = esp_timer_get_time();
+    N=0;
+    n_raw = 0;
+    clipped_samples = 0;
+    resetBin();
+    pretrigger_head = 0;
+    setCpuClock(idle_cpu_mhz);
+    WiFi.setSleep(WIFI_PS_MAX_MODEM);
+    idling = true;
+  }
+  ulTaskNotifyTake(pdTRUE, timeout);
+}
+
+void acquisitionLoop(void *parameter) {
+  uint32_t watched_packets = 0; // finished_packets when the watchdog last idled
+  for (;;) {
+    const bool listening = ws.count() > 0 || live_export_active;
+    // While nobody is, one packet per interval (ms) does for the history and watchdog.
+    unsigned int interval = UINT32_MAX; // (Neither needs any)
+    if (history_capacity > 0) { interval = history_interval; }
+    if (relock_enabled) { interval = min(interval, idle_relock_interval); } // (0: every packet)
+    if (!listening && interval == UINT32_MAX) { //Nobody's listening (or recording), wait.
+      idleAcquisition(portMAX_DELAY);
+      continue;
+    }
+    const RelockState relock = relock_state;
+    const bool relocking = relock_enabled && (relock == RELOCK_SEARCH ||
+      relock == RELOCK_ENGAGE_SLOW || relock == RELOCK_ENGAGE_FAST);
+    if (!listening && interval > 0 && !relocking && finished_packets != watched_packets) {
+      watched_packets = finished_packets; // The packet is taken; wait for the next.
+      idleAcquisition(pdMS_TO_TICKS(interval));
+      continue;
+    }
+    if (idling) {
+      setCpuClock(active_cpu_mhz);
+      WiFi.setSleep(WIFI_PS_MIN_MODEM); // (The default)
+      idling = false;
+    }
+    if (sample_mode == DMA) {
+      if (!dma_running) { // Restart (with a fresh timebase) after idling.
+        startPacket(esp_timer_get_time());
+      }
+      loopDMA();
+    } else {
+      if (!timer_running) { // As for DMA
+        startPacket(esp_timer_get_time());
+      }
+      loopTimer();
+    }
+  }
+}
+
+void updateRateControl(bool congested, bool quick) {
+  /* Called by the streaming task for each packet sent or dropped. After
+  raising the level, further congestion is ignored for a few packets, since
+  packets already in flight were made at the old rate. */
+  static unsigned int holdoff = 0; // Packets to wait after raising the level
+  static unsigned int quick_count = 0; // Consecutive quick sends
+  if (holdoff > 0) { holdoff--; }
+  const unsigned int level = congestion_level;
+  if (congested) {
+    quick_count = 0;
+    if (holdoff == 0 && level < max_point_shift + max_rate_shift) {
+      congestion_level = level + 1;
+      state_changed = true;
+      holdoff = ring_size;
+    }
+  } else if (quick && ++quick_count >= 20 && level > 0) {
+    congestion_level = level - 1;
+    state_changed = true;
+    quick_count = 0;
+  }
+}
+
+void sendStats() {
+  /* Send the stats summary to clients that asked for it (see Subscription):
+  rates and counts since boot, and 99th percentiles (as bucket bounds, in
+  microseconds) over the last second, so a falling-behind board shows at once. */
+  static uint32_t last_jitter[histogram_buckets] = {};
+  static uint32_t last_delivery[histogram_buckets] = {};
+  static uint32_t last_gap[histogram_buckets] = {};
+  char stats[320];
+  snprintf(stats, sizeof(stats),
+    "{\"stats\":{\"packet_rate\":%.1f,\"sent\":%u,\"dropped\":%u,\"skipped\":%u,"
+    "\"encode_shortages\":%u,\"queued\":%u,\"level\":%u,\"jitter_p99\":%u,"
+    "\"latency_p99\":%u,\"gap_p99\":%u,\"free_heap\":%u,\"min_free_heap\":%u}}",
+    packet_rate, (unsigned int)packets_sent, (unsigned int)dropped_packets,
+    (unsigned int)client_skips, (unsigned int)encode_shortages, queued_messages,
+    (unsigned int)congestion_level, recentQuantile(sample_jitter, last_jitter, 0.99f),
+    recentQuantile(delivery_time, last_delivery, 0.99f), recentQuantile(packet_gap, last_gap, 0.99f),
+    (unsigned int)heap_caps_get_free_size(MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL),
+    (unsigned int)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL));
+
+  uint32_t ids[max_subscriptions];
+  int count = 0;
+  portENTER_CRITICAL(&subscriptions_lock);
+  for (int i = 0; i < max_subscriptions; i++) {
+    if (subscriptions[i].client_id != 0 && subscriptions[i].stats) { ids[count++] = subscriptions[i].client_id; }
+  }
+  portEXIT_CRITICAL(&subscriptions_lock);
+  for (int i = 0; i < count; i++) {
+    AsyncWebSocketClient *client = ws.client(ids[i]);
+    if (client && !client->queueIsFull()) { client->text(stats); }
+  }
+}
+
+void streamingLoop(void *parameter) {
+  /* Slots handed to the WebSocket layer, which must not be reused until it has
+  finished with them (checked at least every 10ms, or 2ms while sending). */
+  bool sending[ring_size] = {};
+  bool exporting[ring_size] = {}; // Held by a live export (so not timed)
+  uint64_t sent_time[ring_size];  // When each slot was handed over
+  uint64_t period[ring_size];     // Packet period (elapsed) of each slot
+  unsigned int last_dropped = dropped_packets;
+  unsigned int sent_count = 0;    // Packets sent since rate_window_start
+  uint64_t rate_window_start = esp_timer_get_time();
+  uint64_t last_arrival = 0;      // When the previous packet reached this task
+  float pushed_rate = 0;          // packet_rate in the last state pushed
+  for (;;) {
+    bool any_sending = false;
+    for (int i = 0; i < ring_size; i++) { any_sending |= sending[i]; }
+    // Sleep until acquisition finishes a packet.
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(any_sending ? 2 : 10));
+
+    const uint64_t now = esp_timer_get_time();
+    unsigned int queued = 0;
+    for (int i = 0; i < ring_size; i++) {
+      if (!sending[i]) { continue; }
+      if (ring[i]->canDelete()) {
+        sending[i] = false;
+        free_queue.push(i);
+        if (exporting[i]) { // An export's pace says nothing about the network.
+          exporting[i] = false;
+          continue;
+        }
+        const float latency = now - sent_time[i];
+        send_latency += 0.2 * (latency - send_latency); // Exponential smoothing
+        delivery_time.record(min(now - sent_time[i], (uint64_t)UINT32_MAX));
+        updateRateControl(latency > 2 * period[i], latency < period[i] / 2);
+      } else {
+        queued += ring[i]->count(); // One message per client still sending it
+      }
+    }
+    for (int i = 0; i < encode_pool_size; i++) {
+      if (encode_pool[i]) { queued += encode_pool[i]->count(); }
+    }
+    queued_messages = queued;
+
+    // Packets acquisition had to drop, for lack of a free slot.
+    const unsigned int dropped = dropped_packets;
+    if (dropped != last_dropped) {
+      last_dropped = dropped;
+      updateRateControl(true, false);
+    }
+
+    PacketDescriptor packet;
+    while (packet_queue.pop(packet)) {
+      const uint64_t arrival = esp_timer_get_time();
+      if (last_arrival) { packet_gap.record(min(arrival - last_arrival, (uint64_t)UINT32_MAX)); }
+      last_arrival = arrival;
+      queue_depth.record(queued_messages);
+      ws.cleanupClients();  // Release improperly-closed connections
+      recordHistory(ring[packet.slot]->get());
+      bool slot_held;
+      const uint32_t cycles = ESP.getCycleCount();
+      if (streamPacket(packet, slot_held) > 0) {
+        sent_count++;
+        packets_sent++;
+      }
+      send_time.record(microsSince(cycles));
+      if (offerExport(packet.slot)) {
+        exporting[packet.slot] = true;
+        slot_held = true;
+      }
+      if (slot_held) {
+        sending[packet.slot] = true;
+        sent_time[packet.slot] = esp_timer_get_time();
+        period[packet.slot] = packet.elapsed * rate_divider;
+      } else { // Nobody holds the slot, so it's free straight away.
+        free_queue.push(packet.slot);
+        updateRateControl(false, true);
+      }
+    }
+
+    if (now - rate_window_start >= 1000000) { // Update once a second
+      packet_rate = sent_count * 1e6f / (now - rate_window_start);
+      if (fabsf(packet_rate - pushed_rate) > 0.05f * max(pushed_rate, 1.0f)) { // (See Commands.)
+        pushed_rate = packet_rate;
+        state_changed = true;
+      }
+      sent_count = 0;
+      rate_window_start = now;
+      sendStats();
+    }
+    pushState(now);
+  }
+}
+
+void setupArena() {
+  /* Size packet memory (see packet_capacity) from what's free, preferring
+  PSRAM if the board has it. Ring slots are allocated by the WebSocket
+  library, which (on PSRAM builds) puts blocks this large in PSRAM by itself;
+  the pre-trigger buffer is allocated here. Worst case per sample: 1.5 bytes
+  (12-bit) in each ring slot and a couple of reduced copies, plus 2 bytes of
+  pre-trigger buffer. Room for the history (see setupHistory) is set aside
+first. */
+  const float bytes_per_sample = 1.5f * (ring_size + 2) + 2;
+  arena_psram = psramFound();
+  size_t available;
+  if (arena_psram) {
+    available = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 4 * 3;
+    available -= min(available, history_psram_bytes);
+  } else {
+    const size_t internal = heap_caps_get_free_size(MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL);
+    available = (internal > arena_headroom + history_internal_bytes) ?
+      internal - arena_headroom - history_internal_bytes : 0;
+    // Each slot must also fit in one block.
+    available = min(available, heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / 2 * (ring_size + 2));
+  }
+  packet_capacity = (unsigned int)(available / bytes_per_sample) & ~1023u;
+  packet_capacity = min(max(packet_capacity, min_packet_capacity), max_packet_capacity);
+
+  // Largest power of 2 that fits in a packet
+  pretrigger_capacity = 1;
+  while (pretrigger_capacity * 2 <= packet_capacity) { pretrigger_capacity *= 2; }
+  const uint32_t caps = arena_psram ? MALLOC_CAP_SPIRAM : (MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL);
+  for (;; pretrigger_capacity /= 2) { // Settle for less if need be.
+    pretrigger_buffer = (uint16_t*)heap_caps_malloc(pretrigger_capacity * sizeof(uint16_t), caps);
+    if (pretrigger_buffer || pretrigger_capacity <= 1024) { break; }
+  }
+  if (!pretrigger_buffer) {
+    pretrigger_capacity = 0;
+    Serial.println("No room for the pre-trigger buffer; triggered capture is unavailable.");
+  }
+  Serial.printf("Packet capacity: %u samples (%u pre-trigger) in %s.\n",
+    packet_capacity, pretrigger_capacity, arena_psram ? "PSRAM" : "internal RAM");
+}
+
+void setupADC() {
+  // Characterise ADC1 (see adc_millivolts), at the width and attenuation used throughout.
+  adc1_config_width(ADC_WIDTH_BIT_12);
+  esp_adc_cal_characteristics_t characteristics;
+  adc_calibration_source = esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11,
+    ADC_WIDTH_BIT_12, adc_default_vref, &characteristics);
+  for (uint32_t code = 0; code < 4096; code++) {
+    adc_millivolts[code] = esp_adc_cal_raw_to_voltage(code, &characteristics);
+  }
+  Serial.printf("ADC calibration (%s): %u-%umV.\n", calibrationName(adc_calibration_source),
+    adc_millivolts[0], adc_millivolts[4095]);
+}
+
+void setupHistory() {
+  // Allocate the history (see history_interval), once the config is loaded.
+  history_lock = xSemaphoreCreateMutex();
+  if (history_interval == 0) { return; } // Disabled
+  if (history_file_records > 0) {
+    history_file = LittleFS.open(history_path, "w+"); // Cleared, as record times restart at boot.
+    if (history_file) {
+      history_capacity = history_file_records;
+      Serial.printf("History: %u records in %s.\n", history_capacity, history_path);
+      return;
+    }
+    Serial.println("Unable to create history file; keeping history in RAM.");
+  }
+  const size_t bytes = arena_psram ? history_psram_bytes : history_internal_bytes;
+  history_buffer = (uint8_t*)heap_caps_malloc(bytes,
+    arena_psram ? MALLOC_CAP_SPIRAM : (MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL));
+  history_capacity = history_buffer ? bytes / history_stride : 0;
+  Serial.printf("History: %u records in %s.\n", history_capacity, arena_psram ? "PSRAM" : "internal RAM");
 }
 
 // Setup code, run once upon restart.
@@ -119,13 +2325,29 @@ void setup() {
   // Initial pin outputs
   digitalWrite(SLOW_LOCK_PIN, LOW); // Must begin low
   digitalWrite(FAST_LOCK_PIN, LOW);
-  dacWrite(PZT_DAC_PIN, 255);
+  dacWrite(PZT_DAC_PIN, pzt_offset);
+  const esp_timer_create_args_t pzt_timer_args = {stepPzt, nullptr, ESP_TIMER_TASK, "pzt_slew", true};
+  if (esp_timer_create(&pzt_timer_args, &pzt_timer) != ESP_OK) {
+    Serial.println("Failed to create the PZT slew timer; offsets will jump.");
+    pzt_timer = nullptr;
+  }
 
   // Indicate that board is running
   digitalWrite(LED_PIN, LOW); // Inverted: LOW is on.
 
   // Serial port for debugging purposes
   Serial.begin(115200); // 115200 is baud rate (i.e. Serial communication rate)
+  Serial.printf("Build profile: %s (up to %d channels, %s-bit samples).\n", PROFILE_NAME, max_channels,
+    fixed_sample_bits ? (fixed_sample_bits == 12 ? "12" : "8") : "8 or 12");
+  active_cpu_mhz = cycles_per_us = ESP.getCpuFreqMHz(); // For the instrumentation
+  setupADC();
+
+  // Packet memory, then the ring (slots are resized to each packet's length)
+  setupArena();
+  for (int i = 0; i < ring_size; i++) {
+    ring[i] = new AsyncWebSocketMessageBuffer(sizeof(PacketHeader));
+    if (i != fill_slot) { free_queue.push(i); }
+  }
 
   // Begin filesystem
   if (!LittleFS.begin()) {
@@ -144,15 +2366,35 @@ void setup() {
     Serial.println("Invalid configuration file.");
   }
 
-  static char name[100];
-  strcpy(name, configDoc["name"]); //Laser display name (Defaults to NULL)
+  strlcpy(laser_name, configDoc["name"] | "", sizeof(laser_name)); //Laser display name (Defaults to empty)
 
   // Default sampling settings
   const double configRes = configDoc["default_resolution"];
   const double configDur = configDoc["default_duration"];
-  setSampleSettings(
+  SampleSettings next = pendingSettings();
+  setChannels(next, configDoc["default_channels"]);
+  setSampleSettings(next,
       configRes ? configRes : 2.0,
-      configDur ? configDur : 60.0);
+      configDur ? configDur : 60.0,
+      parseMode(configDoc["default_mode"], POLLED),
+      configDoc["default_bits"] | 8,
+      parseDecimation(configDoc["default_decimation"], DECIMATE_NONE),
+      next.points,
+      parseCapture(configDoc["default_capture"], CAPTURE_CONTINUOUS),
+      configDoc["default_pretrigger"] | 0.5);
+
+  // Auto-relock (off unless enabled)
+  relock_enabled = configDoc["relock"].as<bool>();
+  relock_gain = configDoc["relock_gain"] | relock_gain;
+  relock_range = configDoc["relock_range"] | relock_range;
+  relock_tolerance = configDoc["relock_tolerance"] | relock_tolerance;
+  idle_relock_interval = configDoc["idle_relock_interval"] | idle_relock_interval;
+  pzt_slew_rate = configDoc["pzt_slew_rate"] | pzt_slew_rate;
+
+  // History (interval 0 to disable)
+  history_interval = configDoc["history_interval"] | history_interval;
+  history_file_records = configDoc["history_file_records"] | 0u;
+  setupHistory();
 
   // WiFi details
   const bool host = configDoc["host"]; // Whether to host own network (mainly for testing). If not found in the config file, this value will default to zero, i.e. false.
@@ -235,6 +2477,16 @@ void setup() {
   }
 
   // Serve webpage and handle Websocket events
+  loadStaticAssets();
+  for (int i = 0; i < static_asset_count; i++) {
+    const StaticAsset *asset = &static_assets[i];
+    ArRequestHandlerFunction handler = [asset](AsyncWebServerRequest *request) {
+      serveStaticAsset(request, *asset);
+    };
+    server.on(asset->path.c_str(), HTTP_GET, handler);
+    if (asset->path == "/index.html") { server.on("/", HTTP_GET, handler); }
+  }
+  // Anything else in the filesystem (e.g. files uploaded uncompressed)
   server.serveStatic("/", LittleFS, "/").setDefaultFile("index.html");
   /*
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
@@ -247,77 +2499,38 @@ void setup() {
   server.addHandler(&ws);
 
   // Handle commands (square bracket notation begins an anonymous function)
-  server.on("/status", HTTP_GET, [](AsyncWebServerRequest *request) {
-    StaticJsonDocument<300> statusDoc;
-    statusDoc["name"] = name; // name is static, so can be used in lambda func.
-    statusDoc["slow"] = slow_lock;
-    statusDoc["fast"] = fast_lock;
-    /* Would be convenient to just read the state of the pins directly,
-    but this is unreliable as they are set to OUTPUT mode.*/
-    String statusStr = "";
-    serializeJson(statusDoc, statusStr);
-    request->send(200, "text/plain", statusStr);
-  });
+  server.on("/status", HTTP_GET, jsonHandler<writeStatus>);
   server.on("/enable_slow", HTTP_POST, [](AsyncWebServerRequest *request) {
-    digitalWrite(SLOW_LOCK_PIN, HIGH);
-    slow_lock = true;
+    manualLock(SLOW_LOCK_PIN, slow_lock, true);
     request->send(200);
   });
   server.on("/enable_fast", HTTP_POST, [](AsyncWebServerRequest *request) {
-    digitalWrite(FAST_LOCK_PIN, HIGH);
-    fast_lock = true;
+    manualLock(FAST_LOCK_PIN, fast_lock, true);
     request->send(200);
   });
   server.on("/disable_fast", HTTP_POST, [](AsyncWebServerRequest *request) {
-    digitalWrite(FAST_LOCK_PIN, LOW);
-    fast_lock = false;
+    manualLock(FAST_LOCK_PIN, fast_lock, false);
     request->send(200);
   });
   server.on("/disable_slow", HTTP_POST, [](AsyncWebServerRequest *request) {
-    digitalWrite(SLOW_LOCK_PIN, LOW);
-    slow_lock = false;
+    manualLock(SLOW_LOCK_PIN, slow_lock, false);
     request->send(200);
   });
-  server.on("/get_sample_settings", HTTP_GET, [](AsyncWebServerRequest *request) {
-    /* Tell client what the current sampling settings are */
-    StaticJsonDocument<200> settingsDoc;
-    settingsDoc["duration"] = (double)(sample_duration / 1000.0);
-    settingsDoc["resolution"] = (double)(time_resolution / 1000.0);
-    String settingsStr = "";
-    serializeJson(settingsDoc, settingsStr);
-    request->send(200, "text/plain", settingsStr);
+  server.on("/enable_relock", HTTP_POST, [](AsyncWebServerRequest *request) {
+    setRelock(true);
+    request->send(200);
   });
-  // Handler for receiving sampling settings as JSON.
-  /* There are two possible methods for this. See https://github.com/me-no-dev/ESPAsyncWebServer/issues/195 */
-
-  server.addHandler(new AsyncCallbackJsonWebHandler(
-      "/set_sample_settings",
-      settingsHandler, 1024)); // Last argument is max JSON bytesize
-  /* Alternative pattern: handle chunked reception of body manually
-  server.on("/set_sample_settings", HTTP_POST,
-    [](AsyncWebServerRequest *request) {
-      // Request handler code here. This will be run AFTER all body chunks have been received. The bodyHandler below collects the entire body into request->_tempObject, which you can use here to access the body.
-      //e.g.
-      DynamicJsonBuffer jsonBuffer;
-      JsonObject &root = jsonBuffer.parseObject((const char *)(request->_tempObject));
-      if (root.success()) {
-          if (root.containsKey("command")) {
-            Serial.println(root["command"].asString()); // Hello
-          }
-        }
-    }, NULL,
-    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) { // Body chunk handler
-      // data is chunk bytes, len its bytelength, index which chunk it is, and total the total expected number of bytes.
-      if (total > 0 && request->_tempObject == NULL && total < 10240) { // you may use your own size instead of 10240
-      request->_tempObject = malloc(total); // Create temporary storage
-      }
-      if (request->_tempObject != NULL) {
-        // Add chunk to temporary storage
-        memcpy((uint8_t*)(request->_tempObject) + index, bodyData, bodyLen);
-      }
-    }
+  server.on("/disable_relock", HTTP_POST, [](AsyncWebServerRequest *request) {
+    setRelock(false);
+    request->send(200);
   });
-  */
+  server.on("/history", HTTP_GET, historyHandler);
+  server.on("/export", HTTP_GET, exportHandler);
+  server.on("/metrics", HTTP_GET, metricsHandler);
+  server.on("/calibration", HTTP_GET, calibrationHandler);
+  server.on("/get_sample_settings", HTTP_GET, jsonHandler<writeSettings>);
+  server.on("/set_sample_settings", HTTP_POST, settingsHandler, nullptr, settingsBodyHandler);
+  server.on("/state", HTTP_GET, stateHandler);
 
   // Other pages fail.
   server.onNotFound([](AsyncWebServerRequest *request) {
@@ -327,47 +2540,17 @@ void setup() {
 
   // Start server
   server.begin();
-  packet_start = micros(); // Will be a slight delay for the first packet.
+  startPacket(esp_timer_get_time()); // Will be a slight delay for the first packet.
+
+  // Start tasks. Stack sizes are in bytes.
+  xTaskCreatePinnedToCore(streamingLoop, "streaming", 4096, NULL,
+    streaming_priority, &streaming_task, streaming_core);
+  xTaskCreatePinnedToCore(acquisitionLoop, "acquisition", 4096, NULL,
+    acquisition_priority, &acquisition_task, acquisition_core);
 }
 
 // Run repeatedly after setup()
 void loop() {
-  if (ws.count() == 0) { //Nobody's listening, wait.
-    // Otherwise will not allow the page to load.
-    packet_start = micros();
-    N=0;
-    return;
-  }
-  // Note micros will eventually roll over.
-  elapsed = micros() - packet_start;
-
-  if (elapsed >= time_resolution * N) {
-    // Record a new measurement
-    input_buffer[N++] = (uint8_t)(analogRead(INPUT_PIN) / 16);
-    /* Note: ESP32 ADC has 12-bit resolution, while ESP8266 has only 10-bit.
-    To reduce to 1 byte, we need to divide by 4 on ESP8266 but 16 on ESP32. */
-    // Check if finished packet
-    if ((elapsed >= sample_duration) || N >= buffer_size) {
-      // Send data
-      ws.cleanupClients();  // Release improperly-closed connections
-      if (ws.availableForWriteAll()) {
-        // Send metadata
-        StaticJsonDocument<200> heraldDoc; // Meta-data to precede measurement packet
-        heraldDoc["start"] = (double)(packet_start / 1000.0);
-        heraldDoc["elapsed"] = (double)(elapsed / 1000.0);
-        heraldDoc["trigTime"] = trig_time / 1000.0; // will be 0 if no trigger occurred.
-        String heraldStr;
-        serializeJson(heraldDoc, heraldStr);
-        ws.textAll(heraldStr);
-        // Send measurement packet
-        ws.binaryAll(input_buffer, N); /* Final argument is number of
-          BYTES to send. Note  */
-      }
-      // Start new packet
-      N = 0;
-      trig_time = 0;
-      time_resolution = next_resolution;
-      packet_start = micros();
-    }
-  }
-}
\ No newline at end of file
+  // All work happens in the acquisition and streaming tasks.
+  vTaskDelete(NULL);
+}
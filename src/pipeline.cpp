@@ -0,0 +1,331 @@
+/* Acquisition pipeline (see pipeline.h). */
+
+#include "pipeline.h"
+#include <string.h>
+#include <math.h>
+
+unsigned int channel_count = 1;
+unsigned int time_resolution = 2000; // Microseconds
+
+uint8_t sample_bits = 8;
+
+Decimation decimation = DECIMATE_NONE;
+unsigned int decimation_factor = 1;
+unsigned int raw_samples = 0;
+unsigned int n_raw = 0;
+uint32_t bin_sum[max_channels];
+uint16_t bin_min[max_channels];
+uint16_t bin_max[max_channels];
+unsigned int bin_count = 0;
+unsigned int clipped_samples = 0;
+
+CaptureMode capture_mode = CAPTURE_CONTINUOUS;
+double pretrigger = 0.5;
+CaptureState capture_state = CAPTURING;
+unsigned int pretrigger_capacity = 0;
+uint16_t *pretrigger_buffer = nullptr;
+unsigned int pretrigger_stride = 1;
+unsigned int pretrigger_frames = 0;
+unsigned int pretrigger_head = 0;
+unsigned int pretrigger_samples = 0;
+int64_t capture_trigger = 0;
+
+uint64_t trigger_ring[trigger_ring_size];
+std::atomic<unsigned int> trigger_head(0);
+unsigned int trigger_tail = 0;
+uint64_t stream_start = 0;
+
+uint8_t *input_buffer;
+unsigned int packet_samples = 0;
+bool packet_truncated = false;
+uint64_t packet_start;
+int64_t packet_frame = 0;
+unsigned int N = 0;
+
+void resetBin() {
+  for (int c = 0; c < max_channels; c++) {
+    bin_sum[c] = 0;
+    bin_min[c] = 0xFFFF;
+    bin_max[c] = 0;
+  }
+  bin_count = 0;
+}
+
+void flushBin() {
+  // Store the current bin (which may be partial, at the end of a packet).
+  if (bin_count == 0) { return; }
+  for (unsigned int c = 0; c < frameChannels(); c++) {
+    if (decimation == DECIMATE_ENVELOPE) {
+      storeSample(bin_min[c]);
+      storeSample(bin_max[c]);
+    } else {
+      storeSample((bin_sum[c] + bin_count / 2) / bin_count); // Rounded mean
+    }
+  }
+  resetBin();
+}
+
+static bool peekTrigger(int64_t &position) {
+  /* The oldest trigger not yet passed into a packet, skipping any from before
+  the current packet (or overwritten by the ISR). */
+  const unsigned int head = trigger_head.load(std::memory_order_acquire);
+  if (head - trigger_tail > trigger_ring_size) { trigger_tail = head - trigger_ring_size; }
+  for (; trigger_tail != head; trigger_tail++) {
+    const int64_t since = (int64_t)(trigger_ring[trigger_tail % trigger_ring_size] - stream_start);
+    position = since * (1 << trigger_fraction_bits) / (int64_t)time_resolution;
+    if (position >= packet_frame << trigger_fraction_bits) { return true; }
+  }
+  return false;
+}
+
+void armedFrame(const uint16_t *raw) {
+  /* Record a raw frame while waiting for a trigger, and start the capture
+  once the trigger has occurred (at or before this frame). */
+  const int64_t frame = packet_frame + n_raw; // This frame's position
+  memcpy(pretrigger_buffer + (pretrigger_head++ & (pretrigger_frames - 1)) * pretrigger_stride,
+    raw, frameChannels() * sizeof(uint16_t));
+  n_raw++;
+  int64_t trig;
+  if (peekTrigger(trig) && trig <= frame << trigger_fraction_bits) {
+    /* The packet begins with (up to) pretrigger_samples of the most recent
+    frames. Moving packet_start keeps the sample schedule the same. */
+    const unsigned int pre = std::min(pretrigger_head, pretrigger_samples);
+    /* Signed, as the window can reach back past the last rebase (below),
+    which keeps the frames before it in the ring. */
+    const int64_t skipped = (int64_t)n_raw - pre;
+    packet_start += (int64_t)time_resolution * skipped;
+    packet_frame += skipped;
+    n_raw = 0;
+    capture_trigger = trig;
+    capture_state = CAPTURING;
+    for (unsigned int i = pretrigger_head - pre; i != pretrigger_head; i++) {
+      acceptFrame(pretrigger_buffer + (i & (pretrigger_frames - 1)) * pretrigger_stride);
+    }
+  } else if (n_raw >= pretrigger_frames) {
+    /* Rebase the schedule, so n_raw can't overflow while waiting. The ring is
+    full by now, so pretrigger_head is wound back to just its last lap: the
+    same slots, and still at least pretrigger_samples frames of history. */
+    packet_start += (uint64_t)time_resolution * n_raw;
+    packet_frame += n_raw;
+    n_raw = 0;
+    pretrigger_head = pretrigger_frames + (pretrigger_head & (pretrigger_frames - 1));
+  }
+}
+
+void planPacket(unsigned int duration, unsigned int points, unsigned int capacity) {
+  /* Size the next packet, of duration (microseconds) at the current settings:
+  decimated to about points bins, and holding at most capacity samples. */
+  raw_samples = duration / time_resolution;
+  decimation_factor = 1;
+  const unsigned int max_frames = capacity / channel_count; // Frames that fit
+  if (decimation != DECIMATE_NONE) {
+    const unsigned int per_bin = (decimation == DECIMATE_ENVELOPE) ? 2 : 1;
+    const unsigned int bins = std::min(points, max_frames / per_bin);
+    decimation_factor = std::max((raw_samples + bins - 1) / bins, 1u);
+  }
+  packet_truncated = (decimation_factor == 1 && raw_samples > max_frames);
+  if (decimation_factor == 1) { // No decimation needed
+    raw_samples = std::min(raw_samples, max_frames);
+    packet_samples = raw_samples * channel_count;
+  } else {
+    packet_samples = (raw_samples + decimation_factor - 1) / decimation_factor *
+      ((decimation == DECIMATE_ENVELOPE) ? 2 : 1) * channel_count;
+  }
+}
+
+void resetPacket(uint64_t start) {
+  // Begin filling input_buffer with a fresh packet, starting at start.
+  N = 0;
+  n_raw = 0;
+  clipped_samples = 0;
+  resetBin();
+  // Triggered packets wait for a fresh trigger.
+  capture_state = (capture_mode == CAPTURE_TRIGGERED) ? ARMED : CAPTURING;
+  pretrigger_head = 0;
+  pretrigger_stride = (channel_count > 2) ? 4 : channel_count;
+  pretrigger_frames = pretrigger_capacity / pretrigger_stride;
+  pretrigger_samples = std::min((unsigned int)(pretrigger * raw_samples), pretrigger_frames);
+  packet_start = start; // (On the stream's schedule, so a whole number of frames in.)
+  packet_frame = (start - stream_start) / time_resolution;
+}
+
+PacketHeader packetHeader(uint64_t elapsed) {
+  /* Header of the packet just filled (once its last bin is flushed), elapsed
+  being its length, with the triggers within it. The caller adds the sequence
+  number, the DMA flag and the sweep analysis. */
+  PacketHeader header = {};
+  const int64_t first = packet_frame << trigger_fraction_bits;
+  const int64_t end = (packet_frame + n_raw) << trigger_fraction_bits;
+  const bool capture = (capture_mode == CAPTURE_TRIGGERED);
+  bool triggered = capture;
+  int64_t trig = capture_trigger;
+  if (capture) { // Listed first, even if (with no pre-trigger) it came just before the start
+    header.triggers[header.trigger_count++] = (int32_t)((trig - first) / decimation_factor);
+  }
+  int64_t position;
+  while (peekTrigger(position) && position < end) {
+    if (header.trigger_count < max_packet_triggers && (!capture || position > trig)) {
+      header.triggers[header.trigger_count++] = (int32_t)((position - first) / decimation_factor);
+    }
+    if (!capture) { // trig_offset gives the latest, as when there was one per packet.
+      triggered = true;
+      trig = position;
+    }
+    trigger_tail++;
+  }
+  header.version = packet_format_version;
+  header.header_size = sizeof(PacketHeader);
+  header.flags = (triggered ? PACKET_FLAG_TRIGGERED : 0) |
+    (sampleWidth() == 12 ? PACKET_FLAG_12BIT : 0) |
+    (decimation_factor > 1 ? (decimation == DECIMATE_ENVELOPE ?
+      PACKET_FLAG_ENVELOPE : PACKET_FLAG_AVERAGE) : 0) |
+    (packet_truncated ? PACKET_FLAG_TRUNCATED : 0);
+  header.start = packet_start;
+  header.elapsed = elapsed;
+  header.trig_offset = triggered ?
+    (int32_t)(((trig - first) * time_resolution + (1 << (trigger_fraction_bits - 1))) >> trigger_fraction_bits) : 0;
+  header.samples = N;
+  header.resolution = time_resolution * decimation_factor;
+  header.channels = channel_count;
+  return header;
+}
+
+static inline uint16_t pointValue(const uint8_t *samples, unsigned int i, uint8_t bits, bool envelope) {
+  // Level of the point at sample i: the sample, or the middle of an envelope pair.
+  if (envelope) {
+    return (unpackSample(samples, i, bits) + unpackSample(samples, i + 1, bits)) / 2;
+  }
+  return unpackSample(samples, i, bits);
+}
+
+static void recordPeak(PacketHeader &header, uint32_t offset, uint16_t depth) {
+  // Keep the deepest max_peaks peaks, in time order.
+  int i = header.peak_count;
+  if (i == max_peaks) { // Replace the shallowest, if this is deeper.
+    int shallowest = 0;
+    for (int j = 1; j < max_peaks; j++) {
+      if (header.peaks[j].depth < header.peaks[shallowest].depth) { shallowest = j; }
+    }
+    if (depth <= header.peaks[shallowest].depth) { return; }
+    for (int j = shallowest; j < max_peaks - 1; j++) { header.peaks[j] = header.peaks[j + 1]; }
+    i = max_peaks - 1;
+  } else {
+    header.peak_count++;
+  }
+  // Peaks are found in time order, so this one goes last.
+  header.peaks[i].offset = offset;
+  header.peaks[i].depth = depth;
+}
+
+uint16_t analyseSweep(PacketHeader &header, const uint8_t *samples) {
+  /* Fill in the header's analysis fields (see pipeline.h) from the samples of its
+  first channel. Returns the range of the signal (maximum - minimum). */
+  const uint8_t bits = (header.flags & PACKET_FLAG_12BIT) ? 12 : 8;
+  const bool envelope = header.flags & PACKET_FLAG_ENVELOPE;
+  const unsigned int width = (envelope ? 2 : 1) * header.channels; // Samples per point
+  const unsigned int points = header.samples / width;
+  header.clipped = n_raw ? (uint16_t)((uint64_t)clipped_samples * 0xFFFF / n_raw) : 0;
+  header.peak_count = 0;
+  header.zero_crossing = 0;
+  memset(header.peaks, 0, sizeof(header.peaks));
+
+  uint16_t lo = 0xFFFF;
+  uint16_t hi = 0;
+  for (unsigned int p = 0; p < points; p++) {
+    const uint16_t v = pointValue(samples, p * width, bits, envelope);
+    lo = std::min(lo, v);
+    hi = std::max(hi, v);
+  }
+  if (points < 2 || hi < lo) { return 0; }
+  if (hi - lo < min_peak_contrast) { return hi - lo; }
+
+  const int mid = (hi + lo) / 2;
+  const int leave = mid + (hi - lo) / 8; // Hysteresis for leaving a dip
+  // Target for the zero crossing, in points
+  const float target = (header.flags & PACKET_FLAG_TRIGGERED) ?
+    (float)header.trig_offset / header.resolution : points / 2.0f;
+  float crossing = -1;
+  bool in_dip = false;
+  uint16_t dip_min = 0;
+  unsigned int dip_point = 0;
+  int previous = pointValue(samples, 0, bits, envelope);
+  for (unsigned int p = 0; p < points; p++) {
+    const int v = pointValue(samples, p * width, bits, envelope);
+    if (!in_dip && v < mid) {
+      in_dip = true;
+      dip_min = v;
+      dip_point = p;
+    } else if (in_dip) {
+      if (v < dip_min) {
+        dip_min = v;
+        dip_point = p;
+      }
+      if (v > leave) {
+        recordPeak(header, dip_point * header.resolution, hi - dip_min);
+        in_dip = false;
+      }
+    }
+    if (p > 0 && (previous < mid) != (v < mid)) {
+      const float c = (p - 1) + (float)(mid - previous) / (v - previous); // Interpolated
+      if (crossing < 0 || fabsf(c - target) < fabsf(crossing - target)) { crossing = c; }
+    }
+    previous = v;
+  }
+  if (in_dip) { // Dip cut off by the end of the packet
+    recordPeak(header, dip_point * header.resolution, hi - dip_min);
+  }
+  if (crossing >= 0) {
+    header.flags |= PACKET_FLAG_ZERO_CROSSING;
+    header.zero_crossing = (int32_t)(crossing * header.resolution + 0.5f);
+  }
+  return hi - lo;
+}
+
+size_t encodeReduced(const uint8_t *packet, unsigned int decimate, uint8_t bits, uint8_t *out) {
+  /* Write a reduced copy of a finished packet (header and samples) into out,
+  combining each decimate points and changing the sample width to bits.
+  Returns its length in bytes; if out is null, just works that out. */
+  PacketHeader header;
+  memcpy(&header, packet, sizeof(header));
+  const uint8_t *samples = packet + sizeof(header);
+  const uint8_t in_bits = (header.flags & PACKET_FLAG_12BIT) ? 12 : 8;
+  const bool envelope = header.flags & PACKET_FLAG_ENVELOPE;
+  const unsigned int width = (envelope ? 2 : 1) * std::max(header.channels, (uint8_t)1); // Samples per point
+  const unsigned int in_points = header.samples / width;
+  const unsigned int points = (in_points + decimate - 1) / decimate;
+  header.flags &= ~PACKET_FLAG_12BIT;
+  header.flags |= (bits == 12 ? PACKET_FLAG_12BIT : 0) |
+    (decimate > 1 && !envelope ? PACKET_FLAG_AVERAGE : 0);
+  header.samples = points * width;
+  header.resolution *= decimate;
+  for (unsigned int t = 0; t < header.trigger_count; t++) { header.triggers[t] /= (int32_t)decimate; }
+  const size_t bytes = sizeof(header) + packedBytes(header.samples, bits);
+  if (!out) { return bytes; }
+  uint8_t *data = out;
+  memcpy(data, &header, sizeof(header));
+  data += sizeof(header);
+  for (unsigned int p = 0; p < points; p++) {
+    const unsigned int first = p * decimate;
+    const unsigned int last = std::min(first + decimate, in_points);
+    // Each sample of a point (channel, and min or max) is combined separately.
+    for (unsigned int k = 0; k < width; k++) {
+      uint32_t combined;
+      if (envelope) { // Envelope of the envelopes
+        combined = (k & 1) ? 0 : 0xFFFF;
+        for (unsigned int j = first; j < last; j++) {
+          const uint32_t v = unpackSample(samples, j * width + k, in_bits);
+          combined = (k & 1) ? std::max(combined, v) : std::min(combined, v);
+        }
+      } else {
+        uint32_t sum = 0;
+        for (unsigned int j = first; j < last; j++) {
+          sum += unpackSample(samples, j * width + k, in_bits);
+        }
+        const unsigned int n = last - first;
+        combined = (sum + n / 2) / n; // Rounded mean
+      }
+      packSample(data, p * width + k, combined, bits);
+    }
+  }
+  return bytes;
+}
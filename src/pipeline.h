@@ -0,0 +1,245 @@
+/* Acquisition pipeline: what happens to ADC readings between the ADC and the
+WebSocket. Frames of readings go through the capture and decimation stages
+into the packet buffer, finished packets are analysed, and reductions of them
+are encoded for subscribers. Nothing here touches the hardware or the
+framework, so it also builds natively, where bench/ measures its throughput
+with a simulated ADC (see the native environment in platformio.ini). main.cpp
+applies settings between packets and does the sampling and sending. */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include "profile.h"
+
+const int max_channels = PROFILE_MAX_CHANNELS; // Channels sampled on one timebase (see main.cpp)
+extern unsigned int channel_count;
+
+inline unsigned int frameChannels() {
+  // channel_count, as a constant in single-channel builds (see profile.h)
+  return (max_channels == 1) ? 1 : channel_count;
+}
+extern unsigned int time_resolution; // Microseconds
+
+/* Wire format. Each packet is sent as a single binary WebSocket frame: a
+fixed-layout header followed by the samples. All fields are little-endian
+(the ESP32's native order). The client must check the version, and should
+use header_size to find the samples, so fields can be added at the end. */
+const uint8_t packet_format_version = 1;
+const uint16_t PACKET_FLAG_TRIGGERED = 1 << 0; // trig_offset is valid
+const uint16_t PACKET_FLAG_DMA = 1 << 1;       // Acquired in DMA mode
+const uint16_t PACKET_FLAG_12BIT = 1 << 2;     // Packed 12-bit samples
+const uint16_t PACKET_FLAG_AVERAGE = 1 << 3;   // Samples are bin averages
+const uint16_t PACKET_FLAG_ENVELOPE = 1 << 4;  // Samples are (min, max) pairs
+const uint16_t PACKET_FLAG_ZERO_CROSSING = 1 << 5; // zero_crossing is valid
+const uint16_t PACKET_FLAG_TRUNCATED = 1 << 6; // Cut short by packet_capacity
+const int max_peaks = 4;
+const int max_packet_triggers = 8; // (See Triggers.)
+struct __attribute__((packed)) SweepPeak {
+  uint32_t offset;      // Relative to start (microseconds)
+  uint16_t depth;       // Below the packet's maximum (12-bit ADC counts)
+};
+struct __attribute__((packed)) PacketHeader {
+  uint8_t version;
+  uint8_t header_size;  // Bytes, i.e. offset of the first sample
+  uint16_t flags;
+  uint32_t sequence;    // Counts every packet, so gaps reveal dropped packets
+  uint64_t start;       // Packet start time (microseconds since boot)
+  uint32_t elapsed;     // Packet length (microseconds)
+  int32_t trig_offset;  // Capture trigger (or the latest) relative to start (microseconds)
+  uint32_t samples;     // Number of samples that follow
+  uint32_t resolution;  // Time between samples or bins (microseconds)
+  // Sweep analysis (see analyseSweep)
+  uint16_t clipped;     // Fraction of samples at the ADC's limits (/65535)
+  uint8_t peak_count;   // Number of peaks found
+  uint8_t channels;     // Samples per frame (interleaved)
+  int32_t zero_crossing; // Relative to start (microseconds), if flagged
+  SweepPeak peaks[max_peaks]; // Deepest dips found, in time order
+  uint8_t trigger_count; // Triggers listed
+  uint8_t reserved[3];
+  int32_t triggers[max_packet_triggers]; // In points from start, in 1/256ths (see Triggers)
+};
+static_assert(sizeof(PacketHeader) == 100, "PacketHeader layout changed");
+
+/* Sample width. The ADC gives 12 bits; 8-bit mode keeps the top 8 (one byte
+per sample), while 12-bit mode keeps them all, packing two samples into three
+bytes so it costs 1.5x rather than 2x the memory and bandwidth. Packed layout,
+for samples a (even index) and b (odd index):
+  byte 0: a bits 0-7
+  byte 1: a bits 8-11 (low nibble), b bits 0-3 (high nibble)
+  byte 2: b bits 4-11
+A final unpaired sample occupies two bytes. Changes wait for a new packet. */
+extern uint8_t sample_bits;
+const uint8_t fixed_sample_bits = PROFILE_SAMPLE_BITS; // 0 if chosen at run time
+
+inline uint8_t sampleWidth() {
+  // sample_bits, as a constant in builds with a fixed width (see profile.h)
+  return fixed_sample_bits ? fixed_sample_bits : sample_bits;
+}
+
+/* Decimation. At fine resolutions and long durations a packet can hold far
+more samples than the display has pixels. This stage sits between acquisition
+and the packet buffer, combining each run ('bin') of decimation_factor raw
+samples into either:
+- DECIMATE_AVERAGE: their mean (a boxcar filter), or
+- DECIMATE_ENVELOPE: their minimum and maximum, stored as a pair, so that
+  lone glitches still show.
+The number of bins per packet follows the client's display (display_points),
+and the factor follows from that and the duration and resolution. */
+enum Decimation { DECIMATE_NONE, DECIMATE_AVERAGE, DECIMATE_ENVELOPE };
+extern Decimation decimation;
+extern unsigned int decimation_factor; // Raw frames per bin (current packet)
+extern unsigned int raw_samples;       // Raw frames in the current packet
+extern unsigned int n_raw;             // Raw frames taken so far
+// Bin being accumulated (per channel)
+extern uint32_t bin_sum[max_channels];
+extern uint16_t bin_min[max_channels];
+extern uint16_t bin_max[max_channels];
+extern unsigned int bin_count;
+extern unsigned int clipped_samples; // First-channel readings at the ADC's limits this packet
+
+/* Capture modes:
+- CAPTURE_CONTINUOUS: every packet is sent, back to back.
+- CAPTURE_TRIGGERED: samples go into a circular pre-trigger buffer while
+  armed. A trigger (TRIG_PIN rising edge) starts a packet containing up to
+  'pretrigger' of its duration from before the trigger and the rest from after,
+  so only one packet, aligned to the trigger, is sent per trigger. Triggers
+  arriving during a capture don't start another (though the packet lists
+  them); it re-arms when complete.
+The pre-trigger window is limited to pretrigger_capacity raw samples (set
+with the packet capacity), so fewer frames fit with more channels. */
+enum CaptureMode { CAPTURE_CONTINUOUS, CAPTURE_TRIGGERED };
+extern CaptureMode capture_mode;
+extern double pretrigger; // Fraction of each triggered packet before the trigger
+enum CaptureState { ARMED, CAPTURING };
+extern CaptureState capture_state; // (Always CAPTURING if continuous)
+extern unsigned int pretrigger_capacity; // Must be a power of 2.
+extern uint16_t *pretrigger_buffer;      // Raw frames
+extern unsigned int pretrigger_stride;   // Space per frame (a power of 2, >= channel_count)
+extern unsigned int pretrigger_frames;   // Frames that fit
+extern unsigned int pretrigger_head;     // Raw frames written (wound back in rebases, keeping its slot)
+extern unsigned int pretrigger_samples;  // Window size (frames) for the current packet
+extern int64_t capture_trigger;          // Trigger which started the capture (see Triggers)
+
+/* Triggers. The trigger ISR (main.cpp) records the time of each TRIG_PIN
+rising edge in trigger_ring, which only the ISR writes and only acquisition
+reads, so it needs no lock; if acquisition falls a whole ring behind, the
+oldest are lost. Acquisition places each on the sample clock as it reads it:
+its position in 1/256ths of a frame since frame 0 of the acquisition stream,
+which started at stream_start (a fresh timebase from DMA or the sample
+timer). Each packet lists every trigger that
+fell within it (the first max_packet_triggers), converted to points from its
+start, so a client can align every sweep in a packet exactly, not only one. */
+const int trigger_fraction_bits = 8;
+const unsigned int trigger_ring_size = 16; // Must be a power of 2
+extern uint64_t trigger_ring[trigger_ring_size]; // Trigger times (microseconds)
+extern std::atomic<unsigned int> trigger_head; // Triggers written (wraps around)
+extern unsigned int trigger_tail;              // Triggers read
+extern uint64_t stream_start;                  // Time of frame 0 (microseconds)
+
+// The packet being filled
+extern uint8_t *input_buffer;   // Sample storage (after the header)
+extern unsigned int packet_samples; // Number of samples it will hold
+extern bool packet_truncated;   // Whether it was cut short
+extern uint64_t packet_start;   // Start time (microseconds)
+extern int64_t packet_frame;    // Position of its first frame on the sample clock (frames)
+extern unsigned int N;          // Samples stored so far
+
+/* Sweep analysis. Each finished packet is reduced to a few features, which
+go in its header (and the latest in /status), so that lock monitoring doesn't
+need the waveform:
+- clipped: the fraction of raw readings at the ADC's limits.
+- peaks: the deepest absorption dips, each the minimum of a run of points
+  below the middle of the packet's range (with hysteresis, so noise doesn't
+  split a dip), and its depth below the packet's maximum.
+- zero_crossing: where the signal crosses the middle of its range nearest the
+  trigger (or the packet's centre, if none), as for an error signal.
+It takes two passes over the stored points, so its time is bounded by the
+packet size, and runs in acquisition while the DMA buffers absorb the pause.
+Packets with less than min_peak_contrast between maximum and minimum are
+taken to be flat, with no features. */
+const uint16_t min_peak_contrast = 32; // 12-bit ADC counts
+
+inline size_t packedBytes(unsigned int samples, uint8_t bits) {
+  // Storage needed for samples of the given width.
+  return (bits == 12) ? (3 * samples + 1) / 2 : samples;
+}
+
+inline size_t sampleBytes(unsigned int samples) {
+  // Storage needed for samples at the current sample width.
+  return packedBytes(samples, sampleWidth());
+}
+
+inline void packSample(uint8_t *data, unsigned int i, uint16_t raw, uint8_t bits) {
+  /* Store a 12-bit reading as sample i. Samples must be stored in order, as
+  an odd sample shares a byte with the one before. */
+  if (bits == 12) {
+    uint8_t *pair = data + 3 * (i >> 1); // See packed layout above.
+    if (i & 1) {
+      pair[1] |= (raw & 0x0F) << 4;
+      pair[2] = raw >> 4;
+    } else {
+      pair[0] = raw & 0xFF;
+      pair[1] = raw >> 8;
+    }
+  } else {
+    /* Note: ESP32 ADC has 12-bit resolution, while ESP8266 has only 10-bit.
+    To reduce to 1 byte, we need to divide by 4 on ESP8266 but 16 on ESP32. */
+    data[i] = (uint8_t)(raw >> 4);
+  }
+}
+
+inline uint16_t unpackSample(const uint8_t *data, unsigned int i, uint8_t bits) {
+  // Read back sample i, on the 12-bit scale whatever the width.
+  if (bits == 12) {
+    const uint8_t *pair = data + 3 * (i >> 1);
+    return (i & 1) ? (pair[1] >> 4) | (pair[2] << 4) : pair[0] | ((pair[1] & 0x0F) << 8);
+  }
+  return data[i] << 4;
+}
+
+inline void storeSample(uint16_t raw) {
+  // Append a 12-bit ADC reading to the current packet.
+  packSample(input_buffer, N++, raw, sampleWidth());
+}
+
+void resetBin();
+void flushBin();
+
+inline void acceptFrame(const uint16_t *raw) {
+  // Pass a frame of raw readings through the decimation stage.
+  n_raw++;
+  if (raw[0] == 0 || raw[0] >= 0x0FFF) { clipped_samples++; }
+  if (decimation_factor == 1) {
+    for (unsigned int c = 0; c < frameChannels(); c++) { storeSample(raw[c]); }
+    return;
+  }
+  for (unsigned int c = 0; c < frameChannels(); c++) {
+    bin_sum[c] += raw[c];
+    bin_min[c] = std::min(bin_min[c], raw[c]);
+    bin_max[c] = std::max(bin_max[c], raw[c]);
+  }
+  if (++bin_count == decimation_factor) { flushBin(); }
+}
+
+void armedFrame(const uint16_t *raw);
+
+inline void takeFrame(const uint16_t *raw) {
+  // Entry point for every frame of raw readings (one per channel).
+  if (capture_state == ARMED) {
+    armedFrame(raw);
+  } else {
+    acceptFrame(raw);
+  }
+}
+
+inline bool packetFull() {
+  return capture_state == CAPTURING && n_raw >= raw_samples;
+}
+
+void planPacket(unsigned int duration, unsigned int points, unsigned int capacity);
+void resetPacket(uint64_t start);
+PacketHeader packetHeader(uint64_t elapsed);
+uint16_t analyseSweep(PacketHeader &header, const uint8_t *samples);
+size_t encodeReduced(const uint8_t *packet, unsigned int decimate, uint8_t bits, uint8_t *out);
@@ -0,0 +1,61 @@
+/* Build profiles. What a board is built for fixes some of its limits at
+compile time, so each build only carries (and only branches on) what it can
+do. Each limit below can be set with a -D build flag; platformio.ini has an
+environment for each profile:
+- esp32doit-devkit-v1: every setting chosen at run time (these defaults).
+- fast-single: one channel of 8-bit samples, with a deeper packet ring, for
+  the highest packet rates.
+- multi-12bit: up to four channels of 12-bit samples.
+With one channel, or a fixed sample width, the corresponding run-time setting
+becomes a constant, which the compiler folds into the hot loops (see
+frameChannels() and sampleWidth() in pipeline.h). Also included by the native
+build, so the benchmark can be run for a profile by adding its flags. */
+
+#pragma once
+
+#ifndef PROFILE_NAME
+#define PROFILE_NAME "default" // Reported in /status
+#endif
+#ifndef PROFILE_MAX_CHANNELS
+#define PROFILE_MAX_CHANNELS 4 // Most channels sampled on one timebase
+#endif
+#ifndef PROFILE_SAMPLE_BITS
+#define PROFILE_SAMPLE_BITS 0  // 8 or 12 to fix the sample width (0 to choose)
+#endif
+#ifndef PROFILE_RING_SIZE
+#define PROFILE_RING_SIZE 4    // Packet buffers (a power of 2)
+#endif
+#ifndef PROFILE_MAX_PACKET_CAPACITY
+#define PROFILE_MAX_PACKET_CAPACITY (1 << 18) // Samples, however much memory is free
+#endif
+#ifndef PROFILE_MIN_DURATION
+#define PROFILE_MIN_DURATION 30    // Packet duration limits (ms): shorter or longer
+#endif                             // and the ESP can become unresponsive.
+#ifndef PROFILE_MAX_DURATION
+#define PROFILE_MAX_DURATION 20000
+#endif
+
+// Pin map
+#ifndef PROFILE_LED_PIN
+#define PROFILE_LED_PIN 2
+#endif
+#ifndef PROFILE_TRIG_PIN
+#define PROFILE_TRIG_PIN 14
+#endif
+#ifndef PROFILE_SLOW_LOCK_PIN
+#define PROFILE_SLOW_LOCK_PIN 23
+#endif
+#ifndef PROFILE_FAST_LOCK_PIN
+#define PROFILE_FAST_LOCK_PIN 22
+#endif
+#ifndef PROFILE_INPUT_PIN
+#define PROFILE_INPUT_PIN 34
+#endif
+#ifndef PROFILE_PZT_DAC_PIN
+#define PROFILE_PZT_DAC_PIN 26
+#endif
+
+static_assert(PROFILE_MAX_CHANNELS >= 1 && PROFILE_MAX_CHANNELS <= 4, "1-4 channels");
+static_assert(PROFILE_SAMPLE_BITS == 0 || PROFILE_SAMPLE_BITS == 8 || PROFILE_SAMPLE_BITS == 12,
+  "Sample width must be 0 (chosen), 8 or 12");
+static_assert((PROFILE_RING_SIZE & (PROFILE_RING_SIZE - 1)) == 0, "Ring size must be a power of 2");